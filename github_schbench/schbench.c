@@ -10,6 +10,9 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <limits.h>
 #include <pthread.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -21,17 +24,41 @@
 #include <math.h>
 #include <linux/futex.h>
 #include <sys/syscall.h>
+#include <sys/prctl.h>
+#include <sched.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <linux/io_uring.h>
+#include <signal.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
 
+/*
+ * latencies are recorded in nsecs.  19 groups was enough for usecs, we need
+ * 29 groups to cover the same ~60 second range in nsecs.
+ */
 #define PLAT_BITS	8
 #define PLAT_VAL	(1 << PLAT_BITS)
-#define PLAT_GROUP_NR	19
+#define PLAT_GROUP_NR	29
 #define PLAT_NR		(PLAT_GROUP_NR * PLAT_VAL)
 #define PLAT_LIST_MAX	20
 
-/* when -p is on, how much do we send back and forth */
+/* the most -p will send back and forth */
 #define PIPE_TRANSFER_BUFFER (1 * 1024 * 1024)
 
+#define CACHELINE_SIZE 64
+/* where struct thread_data starts ->stats, so its pages are all its own */
+#define THREAD_STATS_ALIGN 4096
+
 #define USEC_PER_SEC (1000000)
+#define NSEC_PER_USEC (1000ULL)
+#define NSEC_PER_SEC (1000000000ULL)
+#define NSEC_PER_MSEC (1000000ULL)
 
 /* -m number of message threads */
 static int message_threads = 2;
@@ -49,28 +76,307 @@ static int warmuptime = 5;
 static int intervaltime = 10;
 /* -z  seconds */
 static int zerotime = 0;
+/*
+ * --verbose, bool.  The memory and reporter overhead lines, each
+ * interval's own percentiles without --window, and the random seed
+ */
+static int verbose = 0;
+/* --window, also report percentiles over the last N intervals */
+static int window_intervals = 0;
+/* how many intervals are in the window so far, it takes a while to fill */
+static int window_filled = 0;
 /* -c  usec */
 static unsigned long long cputime = 30000;
 /* -f  cache_footprint_kb */
 static unsigned long cache_footprint_kb = 1536;
 /* -n  operations */
 static unsigned long operations = 0;
-/* -a, bool */
-static int autobench = 0;
+/* -a, --slo-search, find the most threads or RPS that still meet --slo */
+enum {
+	SEARCH_NONE = 0,
+	SEARCH_THREADS,
+	SEARCH_RPS,
+};
+static char *search_names[] = { "none", "threads", "rps", NULL };
+static int slo_search = SEARCH_NONE;
+/* --slo pct:usec */
+static double slo_pct = 99.0;
+static unsigned long long slo_usec = 2000;
+/* --probe-time seconds, how long each search step measures for */
+static int probe_time = 5;
+
+/*
+ * --group name:key=val,...  Each group gets its own message threads (and
+ * their -t workers), with its own cputime and rps, optionally in its own
+ * cgroup.  When groups are used, they replace -m
+ */
+#define MAX_GROUPS 16
+#define GROUP_NAME_LEN 32
+
+/*
+ * scheduler settings for a --group or the --hogs.  policy -1 and
+ * has_nice 0 leave the thread alone.  slice is the EEVDF request size,
+ * kernels before 6.12 ignore it
+ */
+struct sched_profile {
+	int policy;
+	/* SCHED_FIFO/SCHED_RR priority */
+	int prio;
+	int nice;
+	int has_nice;
+	/* usec */
+	unsigned long long slice;
+};
+
+struct stats;
+struct worker_group {
+	char name[GROUP_NAME_LEN];
+	/* message threads in this group */
+	int nr_msg;
+	/* usec, -1 for the global -c */
+	long long cputime;
+	/* requests per second for the whole group, 0 for the global -R */
+	unsigned long long rps;
+	/* cgroup knobs, empty or zero to leave alone */
+	int weight;
+	char max[64];
+	char cpus[256];
+	struct sched_profile sched;
+	/* our cgroup directory, empty if we didn't need one */
+	char dir[4096 + 128];
+	/* the latency baseline at the last reset, and the final numbers */
+	struct stats *base;
+	struct stats *final;
+};
+static struct worker_group groups[MAX_GROUPS];
+static int nr_groups = 0;
+/* --cgroup-root, where the group cgroups get made (def: our own cgroup) */
+static char *cgroup_root = NULL;
+
+/*
+ * --hogs N[:key=val,...], background threads that do nothing but burn
+ * cpu, so we can see what they do to the foreground latencies
+ */
+static int nr_hogs = 0;
+static struct sched_profile hog_sched = { .policy = -1 };
+static cpu_set_t hog_cpus;
+static int hog_cpus_set = 0;
 /* -j jitter bool */
 static int jitter = 0;
+
+/* --seed for the per-thread PRNGs, we pick one if it isn't given */
+static unsigned long long rng_seed;
+static int rng_seed_set = 0;
+
+/*
+ * --service-dist and --sleep-dist, what shape -c and -s come in.  -c and -s
+ * stay the mean, except for cdf which brings its own values.
+ */
+enum {
+	DIST_FIXED = 0,
+	DIST_UNIFORM,
+	DIST_EXP,
+	DIST_LOGNORMAL,
+	DIST_BIMODAL,
+	DIST_PARETO,
+	DIST_CDF,
+};
+
+static char *dist_names[] = {
+	[DIST_FIXED] = "fixed",
+	[DIST_UNIFORM] = "uniform",
+	[DIST_EXP] = "exp",
+	[DIST_LOGNORMAL] = "lognormal",
+	[DIST_BIMODAL] = "bimodal",
+	[DIST_PARETO] = "pareto",
+	[DIST_CDF] = "cdf",
+	NULL,
+};
+
+/* pareto draws are capped at this many times the mean */
+#define PARETO_MAX_MEAN 1000
+
+struct dist {
+	int type;
+	/*
+	 * lognormal: sigma
+	 * bimodal: the fraction of slow draws and how many times slower
+	 * they are
+	 * pareto: alpha, more than 1
+	 */
+	double a;
+	double b;
+	/* cdf: usecs and the cumulative fraction at each, both ascending */
+	double *cdf_usec;
+	double *cdf_frac;
+	int cdf_len;
+};
+static struct dist service_dist = { .type = DIST_FIXED };
+static struct dist sleep_dist = { .type = DIST_FIXED };
 /* -A, int percentage busy */
 static int auto_rps = 0;
 /* -p bytes */
 static int pipe_test = 0;
 /* -R requests per sec */
 static unsigned long long requests_per_sec = 0;
+/* --request-pool, requests each worker can have in flight in RPS mode */
+static int request_pool_size = 16;
+
+/* --arrivals, how RPS mode spaces out requests */
+enum {
+	ARRIVALS_BATCH = 0,
+	ARRIVALS_FIXED,
+	ARRIVALS_POISSON,
+	/* --trace picks this one */
+	ARRIVALS_TRACE,
+};
+static int arrivals = ARRIVALS_BATCH;
+
+/*
+ * --trace file, replay request arrivals from it.  Each line is
+ * "offset_usec service_usec [class]", offsets from the start of the trace
+ * in order.  Classes get their own latency histograms, and with -n a
+ * class N request also makes N passes over the --kernel working set
+ */
+#define MAX_TRACE_CLASSES 8
+struct trace_entry {
+	/* nsecs from the start of the trace */
+	unsigned long long offset;
+	/* usecs */
+	unsigned long long service;
+	int class;
+};
+static char *trace_path = NULL;
+static struct trace_entry *trace;
+static unsigned long nr_trace;
+/* one loop of the trace in nsecs, before --trace-speed */
+static unsigned long long trace_duration;
+static int trace_classes;
+/* --trace-speed, 2 replays twice as fast */
+static double trace_speed = 1.0;
+/* --trace-loop, start the trace over when it runs out, bool */
+static int trace_loop = 0;
+/* --steal, bool */
+static int steal = 0;
+
+/* --placement, how threads get pinned to CPUs */
+enum {
+	PLACEMENT_UNSET = 0,
+	PLACEMENT_NONE,
+	PLACEMENT_COMPACT,
+	PLACEMENT_SCATTER,
+	PLACEMENT_LLC,
+	PLACEMENT_NUMA,
+	PLACEMENT_SMT_PAIR,
+};
+static char *placement_names[] = { "unset", "none", "compact", "scatter",
+				   "llc", "numa", "smt-pair", NULL };
+static int placement = PLACEMENT_UNSET;
+
+/* --wake, how a blocked thread sleeps and gets kicked */
+enum {
+	WAKE_FUTEX = 0,
+	WAKE_EVENTFD,
+	WAKE_PIPE,
+	WAKE_EPOLL,
+	WAKE_FUTEX_WAITV,
+	WAKE_IO_URING,
+};
+static char *wake_names[] = { "futex", "eventfd", "pipe", "epoll",
+			      "futex-waitv", "io-uring", NULL };
+static int wake_backend = WAKE_FUTEX;
+
+/* --wake-fanout, most posts any one thread makes per wakeup round, 0 is all */
+static int wake_fanout = 0;
+
+/* --pipe-transport, how -p mode moves its bytes */
+enum {
+	TRANSPORT_MEMSET = 0,
+	TRANSPORT_PIPE,
+	TRANSPORT_SOCKETPAIR,
+	TRANSPORT_SHM,
+	TRANSPORT_VMSPLICE,
+};
+static char *transport_names[] = { "memset", "pipe", "socketpair", "shm",
+				   "vmsplice", NULL };
+static int transport = TRANSPORT_PIPE;
+
+/* --kernel, what -n operations over -F kb of memory actually do */
+enum {
+	KERNEL_MATMUL = 0,
+	KERNEL_CHASE,
+	KERNEL_STREAM,
+	KERNEL_BLOCKED_MATMUL,
+	KERNEL_HASH,
+};
+static char *kernel_names[] = { "matmul", "chase", "stream", "blocked-matmul",
+				"hash", NULL };
+static int work_kernel = KERNEL_MATMUL;
+/* --breakdown, bool */
+static int breakdown = 0;
+
+/* --schedstat, sample /proc/schedstat at every interval, bool */
+static int schedstat = 0;
+
+/* --task-stats, sample every worker's kernel sched accounting, bool */
+static int task_stats = 0;
+
+/*
+ * --stall-detect, nsecs between two clock reads in a spin that we count as
+ * the thread being stalled, 0 is off
+ */
+static unsigned long long stall_thresh_ns = 0;
+
+/* --json and --csv, machine readable reports go to output_fd */
+enum {
+	OUTPUT_TEXT = 0,
+	OUTPUT_JSON,
+	OUTPUT_CSV,
+};
+static int output_format = OUTPUT_TEXT;
+/* --output-fd */
+static int output_fd = 1;
+
+/* --hist-log, binary histogram records go here */
+static char *hist_log_path = NULL;
+static int hist_log_fd = -1;
+/* --hist-merge and --hist-diff read logs instead of running the benchmark */
+enum {
+	HIST_TOOL_NONE = 0,
+	HIST_TOOL_MERGE,
+	HIST_TOOL_DIFF,
+};
+static int hist_tool = HIST_TOOL_NONE;
+/* --hist-diff, comma separated list of the baseline logs */
+static char *hist_diff_base = NULL;
+/* the logs named after the options */
+static char **hist_files = NULL;
+static int nr_hist_files = 0;
+/* --tsc, bool */
+static int use_tsc = 0;
+/* --units, latencies are recorded in nsec and divided by this for printing */
+static unsigned long long report_div = NSEC_PER_USEC;
+static char *report_units = "usec";
 
 /* the message threads flip this to true when they decide runtime is up */
 static volatile unsigned long stopping = 0;
 
+/*
+ * bumped by the reporter every time stats are zeroed.  Workers notice the
+ * change and restart their min/max tracking
+ */
+static volatile unsigned long stats_epoch = 0;
+
+/*
+ * workers per message thread that take part, the rest are parked.  This
+ * is worker_threads unless --slo-search is varying the thread count
+ */
+static volatile int active_workers = 0;
+
 /* size of matrices to multiply */
 static unsigned long matrix_size = 0;
+/* elements in the --kernel working set for the non-matrix kernels */
+static unsigned long kernel_elems = 0;
 
 
 /*
@@ -82,17 +388,89 @@ static unsigned long matrix_size = 0;
 struct stats {
 	unsigned int plat[PLAT_NR];
 	unsigned long nr_samples;
-	unsigned int max;
-	unsigned int min;
+	unsigned long long max;
+	unsigned long long min;
+	/*
+	 * plat[] is all zeros outside of [lo, hi), hi is zero when nothing
+	 * was recorded.  Latencies bunch up in a few hundred buckets, so
+	 * the reporter only copies and adds this part
+	 */
+	unsigned int lo;
+	unsigned int hi;
+};
+
+/*
+ * workers always fill in LAT_TOTAL, which lives in thread_data->stats.  The
+ * others break a request down into pieces and are only allocated by the
+ * modes that record them
+ */
+enum {
+	LAT_TOTAL = 0,
+	/* from the waker's post until the worker is running */
+	LAT_WAKEUP,
+	/* from a request's intended arrival until a worker starts it */
+	LAT_QUEUE,
+	/* from starting the work until it's done */
+	LAT_SERVICE,
+	/* with --placement, wakeups are also split up by where the waker ran */
+	LAT_SAME_CORE,
+	LAT_SAME_LLC,
+	LAT_CROSS_LLC,
+	LAT_CROSS_NODE,
+	/* with --stall-detect, the gaps our spin loops noticed */
+	LAT_STALL,
+	/* with --trace, the total for each request class */
+	LAT_CLASS0,
+	NR_LAT_STATS = LAT_CLASS0 + MAX_TRACE_CLASSES,
 };
+static char *lat_stats_names[NR_LAT_STATS] = { "total", "wakeup", "queue", "service",
+	"same-core", "same-llc", "cross-llc", "cross-node", "stall",
+	"class0", "class1", "class2", "class3",
+	"class4", "class5", "class6", "class7" };
 
 /* this defines which latency profiles get printed */
+#define PLIST_P999 6
 #define PLIST_P99 4
 #define PLIST_P95 3
+#define PLIST_P50 0
 static double plist[PLAT_LIST_MAX] = { 50.0, 75.0, 90.0, 95.0, 99.0, 99.5, 99.9 };
 
 enum {
 	HELP_LONG_OPT = 1,
+	TSC_LONG_OPT,
+	UNITS_LONG_OPT,
+	REQUEST_POOL_LONG_OPT,
+	ARRIVALS_LONG_OPT,
+	STEAL_LONG_OPT,
+	PLACEMENT_LONG_OPT,
+	BREAKDOWN_LONG_OPT,
+	JSON_LONG_OPT,
+	CSV_LONG_OPT,
+	OUTPUT_FD_LONG_OPT,
+	HIST_LOG_LONG_OPT,
+	HIST_MERGE_LONG_OPT,
+	HIST_DIFF_LONG_OPT,
+	WAKE_LONG_OPT,
+	PIPE_TRANSPORT_LONG_OPT,
+	KERNEL_LONG_OPT,
+	SLO_SEARCH_LONG_OPT,
+	SLO_LONG_OPT,
+	PROBE_TIME_LONG_OPT,
+	GROUP_LONG_OPT,
+	CGROUP_ROOT_LONG_OPT,
+	HOGS_LONG_OPT,
+	SCHEDSTAT_LONG_OPT,
+	TASK_STATS_LONG_OPT,
+	WINDOW_LONG_OPT,
+	WAKE_FANOUT_LONG_OPT,
+	TRACE_LONG_OPT,
+	TRACE_SPEED_LONG_OPT,
+	TRACE_LOOP_LONG_OPT,
+	SEED_LONG_OPT,
+	SERVICE_DIST_LONG_OPT,
+	SLEEP_DIST_LONG_OPT,
+	STALL_DETECT_LONG_OPT,
+	VERBOSE_LONG_OPT,
 };
 
 char *option_string = "p:am:t:s:c:C:r:R:w:i:z:A:jn:F:";
@@ -106,13 +484,47 @@ static struct option long_options[] = {
 	{"rps", required_argument, 0, 'R'},
 	{"auto-rps", required_argument, 0, 'A'},
 	{"sleeptime", required_argument, 0, 's'},
+	{"sleep-dist", required_argument, 0, SLEEP_DIST_LONG_OPT},
 	{"message_cputime", required_argument, 0, 'C'},
 	{"cputime", required_argument, 0, 'c'},
+	{"service-dist", required_argument, 0, SERVICE_DIST_LONG_OPT},
+	{"seed", required_argument, 0, SEED_LONG_OPT},
 	{"cache_footprint", required_argument, 0, 'f'},
 	{"operations", required_argument, 0, 'n'},
 	{"warmuptime", required_argument, 0, 'w'},
 	{"intervaltime", required_argument, 0, 'i'},
 	{"zerotime", required_argument, 0, 'z'},
+	{"window", required_argument, 0, WINDOW_LONG_OPT},
+	{"tsc", no_argument, 0, TSC_LONG_OPT},
+	{"units", required_argument, 0, UNITS_LONG_OPT},
+	{"request-pool", required_argument, 0, REQUEST_POOL_LONG_OPT},
+	{"arrivals", required_argument, 0, ARRIVALS_LONG_OPT},
+	{"trace", required_argument, 0, TRACE_LONG_OPT},
+	{"trace-speed", required_argument, 0, TRACE_SPEED_LONG_OPT},
+	{"trace-loop", no_argument, 0, TRACE_LOOP_LONG_OPT},
+	{"steal", no_argument, 0, STEAL_LONG_OPT},
+	{"placement", required_argument, 0, PLACEMENT_LONG_OPT},
+	{"breakdown", no_argument, 0, BREAKDOWN_LONG_OPT},
+	{"json", no_argument, 0, JSON_LONG_OPT},
+	{"csv", no_argument, 0, CSV_LONG_OPT},
+	{"output-fd", required_argument, 0, OUTPUT_FD_LONG_OPT},
+	{"hist-log", required_argument, 0, HIST_LOG_LONG_OPT},
+	{"hist-merge", no_argument, 0, HIST_MERGE_LONG_OPT},
+	{"hist-diff", required_argument, 0, HIST_DIFF_LONG_OPT},
+	{"wake", required_argument, 0, WAKE_LONG_OPT},
+	{"wake-fanout", required_argument, 0, WAKE_FANOUT_LONG_OPT},
+	{"pipe-transport", required_argument, 0, PIPE_TRANSPORT_LONG_OPT},
+	{"kernel", required_argument, 0, KERNEL_LONG_OPT},
+	{"slo-search", required_argument, 0, SLO_SEARCH_LONG_OPT},
+	{"slo", required_argument, 0, SLO_LONG_OPT},
+	{"probe-time", required_argument, 0, PROBE_TIME_LONG_OPT},
+	{"group", required_argument, 0, GROUP_LONG_OPT},
+	{"cgroup-root", required_argument, 0, CGROUP_ROOT_LONG_OPT},
+	{"hogs", required_argument, 0, HOGS_LONG_OPT},
+	{"schedstat", no_argument, 0, SCHEDSTAT_LONG_OPT},
+	{"task-stats", no_argument, 0, TASK_STATS_LONG_OPT},
+	{"stall-detect", required_argument, 0, STALL_DETECT_LONG_OPT},
+	{"verbose", no_argument, 0, VERBOSE_LONG_OPT},
 	{"help", no_argument, 0, HELP_LONG_OPT},
 	{0, 0, 0, 0}
 };
@@ -126,9 +538,28 @@ static void print_usage(void)
 		"\t-s (--sleeptime): Message thread latency (usec, def: 30000\n"
 		"\t-C (--message_cputime): Message thread think time (usec, def: 30000\n"
 		"\t-c (--cputime): How long to think during loop (usec, def: 30000\n"
+		"\t--service-dist: shape of -c, with -c as the mean (def: fixed)\n"
+		"\t\tfixed|uniform|exp|lognormal[:sigma]|bimodal[:frac,slower]|\n"
+		"\t\tpareto[:alpha]|cdf:file of 'usec cumulative_fraction' lines\n"
+		"\t--sleep-dist: shape of -s, same choices as --service-dist (def: fixed)\n"
+		"\t--seed: seed for the random draws, to repeat a run (def: random)\n"
 		"\t-F (--cache_footprint): cache footprint (kb, def: 6144)\n"
 		"\t-n (--operations): operations to perform (def: 0)\n"
-		"\t-a (--auto): grow thread count until latencies hurt (def: off)\n"
+		"\t--kernel: the work each operation does over the -F footprint\n"
+		"\t\t(matmul|chase|stream|blocked-matmul|hash, def: matmul)\n"
+		"\t-a (--auto): same as --slo-search threads (def: off)\n"
+		"\t--slo-search: find the most threads (up to -t) or RPS that meet --slo\n"
+		"\t\t(threads|rps, def: off)\n"
+		"\t--slo: percentile:usec target for --slo-search (def: 99:2000)\n"
+		"\t--probe-time: seconds to measure each --slo-search step (def: 5)\n"
+		"\t--group name[:key=val,...]: add a worker group, repeat for more.  Keys:\n"
+		"\t\tm=message threads, cputime=usec, rps=group total (def: -R),\n"
+		"\t\tweight=cpu.weight, max=quota[/period] usec, cpus=cpuset list,\n"
+		"\t\tpolicy=other|batch|idle|fifo|rr, prio=rt priority, nice=N,\n"
+		"\t\tslice=EEVDF slice usec\n"
+		"\t--cgroup-root: cgroup v2 dir to make group cgroups in (def: our own)\n"
+		"\t--hogs N[:key=val,...]: background threads that just burn cpu (def: 0)\n"
+		"\t\tKeys: policy, prio, nice and slice as for --group, cpus=cpu list\n"
 		"\t-j (--jitter): add jitter to sleep/cputimes (def: off)\n"
 		"\t-A (--auto-rps): grow RPS until cpu utilization hits target (def: none)\n"
 		"\t-p (--pipe): transfer size bytes to simulate a pipe test (def: 0)\n"
@@ -136,13 +567,333 @@ static void print_usage(void)
 		"\t-w (--warmuptime): how long to warmup before resettings stats (seconds, def: 5)\n"
 		"\t-i (--intervaltime): interval for printing latencies (seconds, def: 10)\n"
 		"\t-z (--zerotime): interval for zeroing latencies (seconds, def: never)\n"
+		"\t--window: also report percentiles over the last N intervals (count, def: off)\n"
+		"\t--tsc: use a calibrated TSC instead of CLOCK_MONOTONIC for timestamps (def: off)\n"
+		"\t--units: print latencies in nsec or usec (ns|us, def: us)\n"
+		"\t--request-pool: preallocated requests per worker in RPS mode (count, def: 16)\n"
+		"\t--arrivals: RPS mode request spacing (batch|fixed|poisson, def: batch)\n"
+		"\t--trace: replay 'offset_usec service_usec [class]' lines as RPS requests\n"
+		"\t--trace-speed: replay the --trace this many times faster (def: 1)\n"
+		"\t--trace-loop: start the --trace over when it runs out (def: off)\n"
+		"\t--steal: RPS mode workers steal queued requests from each other (def: off)\n"
+		"\t--placement: pin threads and report latency by wakeup locality\n"
+		"\t\t(none|compact|scatter|llc|numa|smt-pair, def: off)\n"
+		"\t--breakdown: split latencies into wakeup, queue and service time (def: off)\n"
+		"\t--schedstat: report /proc/schedstat deltas with every interval (def: off)\n"
+		"\t--task-stats: report each worker's kernel run delay and migrations (def: off)\n"
+		"\t--stall-detect: record gaps over this long inside spin loops as stalls,\n"
+		"\t\tby cpu and next to /proc/stat steal time (usec, def: off)\n"
+		"\t--json: write a JSON record with full histograms for every interval (def: off)\n"
+		"\t--csv: same as --json, but as CSV rows (def: off)\n"
+		"\t--output-fd: file descriptor for --json and --csv records (def: 1)\n"
+		"\t\tthe text report moves to stderr when records go to stdout\n"
+		"\t--hist-log: write binary histograms for every interval to this file (def: off)\n"
+		"\t--hist-merge log...: merge the final histograms from logs and report them\n"
+		"\t--hist-diff base,... log...: compare merged baseline logs against the others\n"
+		"\t--wake: how threads sleep and get woken\n"
+		"\t\t(futex|eventfd|pipe|epoll|futex-waitv|io-uring, def: futex)\n"
+		"\t--wake-fanout: message threads wake this many workers, who wake the rest\n"
+		"\t\tin a tree, and report the cpu each wake costs the waker\n"
+		"\t\t(count, def: 0, the message thread wakes everyone)\n"
+		"\t--pipe-transport: how -p moves bytes between threads\n"
+		"\t\t(memset|pipe|socketpair|shm|vmsplice, def: pipe, RPS mode: memset)\n"
+		"\t--verbose: also report memory use, reporter overhead, each interval's\n"
+		"\t\town percentiles and the random seed (def: off)\n"
 	       );
 	exit(1);
 }
 
+static struct {
+	char *name;
+	int policy;
+} sched_policies[] = {
+	{ "other", SCHED_OTHER },
+	{ "batch", SCHED_BATCH },
+	{ "idle", SCHED_IDLE },
+	{ "fifo", SCHED_FIFO },
+	{ "rr", SCHED_RR },
+	{ NULL, 0 },
+};
+
+static char *sched_policy_name(int policy)
+{
+	int i;
+
+	for (i = 0; sched_policies[i].name; i++) {
+		if (sched_policies[i].policy == policy)
+			return sched_policies[i].name;
+	}
+	return "unknown";
+}
+
+/* returns 1 if key was one of the struct sched_profile keys */
+static int parse_sched_key(struct sched_profile *p, char *key, char *val)
+{
+	int i;
+
+	if (!strcmp(key, "policy")) {
+		for (i = 0; sched_policies[i].name; i++) {
+			if (!strcmp(val, sched_policies[i].name))
+				break;
+		}
+		if (!sched_policies[i].name) {
+			fprintf(stderr, "unknown scheduling policy '%s'\n", val);
+			exit(1);
+		}
+		p->policy = sched_policies[i].policy;
+	} else if (!strcmp(key, "prio")) {
+		p->prio = atoi(val);
+	} else if (!strcmp(key, "nice")) {
+		p->nice = atoi(val);
+		p->has_nice = 1;
+	} else if (!strcmp(key, "slice")) {
+		p->slice = atoll(val);
+	} else {
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * cdf:file, one 'usec cumulative_fraction' pair per line with both going
+ * up.  The fractions don't have to end at 1, we scale by the last one
+ */
+static void load_cdf(struct dist *d, char *path)
+{
+	double usec, frac;
+	double last_usec = 0, last_frac = 0;
+	int alloced = 0;
+	int lineno = 0;
+	char line[256];
+	char *p;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		perror(path);
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+		p = line + strspn(line, " \t\r\n");
+		if (!*p || *p == '#')
+			continue;
+		if (sscanf(p, "%lf %lf", &usec, &frac) != 2 || usec < 0 ||
+		    frac <= 0 || usec < last_usec || frac < last_frac) {
+			fprintf(stderr, "%s:%d: want ascending 'usec cumulative_fraction'\n",
+				path, lineno);
+			exit(1);
+		}
+		last_usec = usec;
+		last_frac = frac;
+
+		if (d->cdf_len == alloced) {
+			alloced = alloced ? alloced * 2 : 64;
+			d->cdf_usec = realloc(d->cdf_usec, alloced * sizeof(double));
+			d->cdf_frac = realloc(d->cdf_frac, alloced * sizeof(double));
+			if (!d->cdf_usec || !d->cdf_frac) {
+				perror("unable to allocate cdf");
+				exit(1);
+			}
+		}
+		d->cdf_usec[d->cdf_len] = usec;
+		d->cdf_frac[d->cdf_len] = frac;
+		d->cdf_len++;
+	}
+	fclose(fp);
+	if (!d->cdf_len) {
+		fprintf(stderr, "%s has no cdf points\n", path);
+		exit(1);
+	}
+}
+
+/* name[:arg[,arg]] for --service-dist and --sleep-dist */
+static void parse_dist(struct dist *d, char *spec)
+{
+	char *args = strchr(spec, ':');
+	size_t len = args ? (size_t)(args - spec) : strlen(spec);
+	int i;
+
+	for (i = 0; dist_names[i]; i++) {
+		if (strlen(dist_names[i]) == len && !strncmp(spec, dist_names[i], len))
+			break;
+	}
+	if (!dist_names[i]) {
+		fprintf(stderr, "unknown distribution '%s'\n", spec);
+		print_usage();
+	}
+	d->type = i;
+	if (args)
+		args++;
+
+	switch (d->type) {
+	case DIST_LOGNORMAL:
+		d->a = args ? atof(args) : 1.0;
+		if (d->a <= 0) {
+			fprintf(stderr, "lognormal sigma must be more than zero\n");
+			exit(1);
+		}
+		break;
+	case DIST_BIMODAL:
+		d->a = 0.1;
+		d->b = 10;
+		if (args && sscanf(args, "%lf,%lf", &d->a, &d->b) < 1)
+			d->a = -1;
+		if (d->a <= 0 || d->a >= 1 || d->b < 1) {
+			fprintf(stderr, "bimodal wants frac between 0 and 1 and slower >= 1\n");
+			exit(1);
+		}
+		break;
+	case DIST_PARETO:
+		d->a = args ? atof(args) : 1.5;
+		if (d->a <= 1) {
+			fprintf(stderr, "pareto alpha must be more than 1 to have a mean\n");
+			exit(1);
+		}
+		break;
+	case DIST_CDF:
+		if (!args || !*args) {
+			fprintf(stderr, "cdf needs a file, cdf:path\n");
+			exit(1);
+		}
+		load_cdf(d, args);
+		break;
+	default:
+		break;
+	}
+}
+
+/* 0-3,8,10-11 */
+static void parse_cpu_list(char *list, cpu_set_t *set)
+{
+	char *p = list;
+	char *end;
+	long first;
+	long last;
+
+	CPU_ZERO(set);
+	while (*p) {
+		first = strtol(p, &end, 10);
+		last = first;
+		if (end != p && *end == '-') {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+		}
+		if (end == p || first < 0 || last < first || last >= CPU_SETSIZE ||
+		    (*end && *end != ',')) {
+			fprintf(stderr, "bad cpu list '%s'\n", list);
+			exit(1);
+		}
+		for (; first <= last; first++)
+			CPU_SET(first, set);
+		p = *end ? end + 1 : end;
+	}
+}
+
+/* N:key=val,key=val */
+static void parse_hogs(char *spec)
+{
+	char *keys;
+	char *kv;
+	char *val;
+	char *save = NULL;
+
+	keys = strchr(spec, ':');
+	if (keys)
+		*keys++ = '\0';
+	nr_hogs = atoi(spec);
+	if (nr_hogs < 0) {
+		fprintf(stderr, "bad hog count '%s'\n", spec);
+		exit(1);
+	}
+
+	for (kv = keys ? strtok_r(keys, ",", &save) : NULL; kv;
+	     kv = strtok_r(NULL, ",", &save)) {
+		val = strchr(kv, '=');
+		if (!val) {
+			fprintf(stderr, "hogs: '%s' needs a value\n", kv);
+			exit(1);
+		}
+		*val++ = '\0';
+		if (parse_sched_key(&hog_sched, kv, val))
+			continue;
+		if (!strcmp(kv, "cpus")) {
+			parse_cpu_list(val, &hog_cpus);
+			hog_cpus_set = 1;
+		} else {
+			fprintf(stderr, "hogs: unknown key '%s'\n", kv);
+			exit(1);
+		}
+	}
+}
+
+/* name:key=val,key=val */
+static void parse_group(char *spec)
+{
+	struct worker_group *g;
+	char *keys;
+	char *kv;
+	char *val;
+	char *save = NULL;
+
+	if (nr_groups == MAX_GROUPS) {
+		fprintf(stderr, "at most %d groups\n", MAX_GROUPS);
+		exit(1);
+	}
+	g = groups + nr_groups++;
+	g->nr_msg = 1;
+	g->cputime = -1;
+	g->sched.policy = -1;
+
+	keys = strchr(spec, ':');
+	if (keys)
+		*keys++ = '\0';
+	if (!spec[0] || strlen(spec) >= GROUP_NAME_LEN || strchr(spec, '/')) {
+		fprintf(stderr, "bad group name '%s'\n", spec);
+		exit(1);
+	}
+	strcpy(g->name, spec);
+
+	for (kv = keys ? strtok_r(keys, ",", &save) : NULL; kv;
+	     kv = strtok_r(NULL, ",", &save)) {
+		val = strchr(kv, '=');
+		if (!val) {
+			fprintf(stderr, "group %s: '%s' needs a value\n", g->name, kv);
+			exit(1);
+		}
+		*val++ = '\0';
+		if (parse_sched_key(&g->sched, kv, val))
+			continue;
+		if (!strcmp(kv, "m")) {
+			g->nr_msg = atoi(val);
+		} else if (!strcmp(kv, "cputime")) {
+			g->cputime = atoll(val);
+		} else if (!strcmp(kv, "rps")) {
+			g->rps = atoll(val);
+		} else if (!strcmp(kv, "weight")) {
+			g->weight = atoi(val);
+		} else if (!strcmp(kv, "max")) {
+			snprintf(g->max, sizeof(g->max), "%s", val);
+			/* cpu.max wants "quota period" */
+			if ((val = strchr(g->max, '/')) != NULL)
+				*val = ' ';
+		} else if (!strcmp(kv, "cpus")) {
+			snprintf(g->cpus, sizeof(g->cpus), "%s", val);
+		} else {
+			fprintf(stderr, "group %s: unknown key '%s'\n", g->name, kv);
+			exit(1);
+		}
+	}
+	if (g->nr_msg < 1) {
+		fprintf(stderr, "group %s needs at least one message thread\n", g->name);
+		exit(1);
+	}
+}
+
 static void parse_options(int ac, char **av)
 {
 	int c;
+	int i;
 	int found_sleeptime = -1;
 	int found_cputime = -1;
 	int found_warmuptime = -1;
@@ -159,7 +910,7 @@ static void parse_options(int ac, char **av)
 
 		switch(c) {
 		case 'a':
-			autobench = 1;
+			slo_search = SEARCH_THREADS;
 			warmuptime = 0;
 			break;
 		case 'j':
@@ -219,6 +970,202 @@ static void parse_options(int ac, char **av)
 		case 'F':
 			cache_footprint_kb = atoi(optarg);
 			break;
+		case TSC_LONG_OPT:
+			use_tsc = 1;
+			break;
+		case UNITS_LONG_OPT:
+			if (!strcmp(optarg, "ns") || !strcmp(optarg, "nsec")) {
+				report_div = 1;
+				report_units = "nsec";
+			} else if (!strcmp(optarg, "us") || !strcmp(optarg, "usec")) {
+				report_div = NSEC_PER_USEC;
+				report_units = "usec";
+			} else {
+				fprintf(stderr, "unknown units '%s'\n", optarg);
+				print_usage();
+			}
+			break;
+		case REQUEST_POOL_LONG_OPT:
+			request_pool_size = atoi(optarg);
+			if (request_pool_size < 1) {
+				fprintf(stderr, "request pool must hold at least one request\n");
+				exit(1);
+			}
+			break;
+		case ARRIVALS_LONG_OPT:
+			if (!strcmp(optarg, "batch")) {
+				arrivals = ARRIVALS_BATCH;
+			} else if (!strcmp(optarg, "fixed")) {
+				arrivals = ARRIVALS_FIXED;
+			} else if (!strcmp(optarg, "poisson")) {
+				arrivals = ARRIVALS_POISSON;
+			} else {
+				fprintf(stderr, "unknown arrivals '%s'\n", optarg);
+				print_usage();
+			}
+			break;
+		case TRACE_LONG_OPT:
+			trace_path = optarg;
+			arrivals = ARRIVALS_TRACE;
+			break;
+		case TRACE_SPEED_LONG_OPT:
+			trace_speed = atof(optarg);
+			if (trace_speed <= 0) {
+				fprintf(stderr, "--trace-speed must be more than zero\n");
+				exit(1);
+			}
+			break;
+		case TRACE_LOOP_LONG_OPT:
+			trace_loop = 1;
+			break;
+		case VERBOSE_LONG_OPT:
+			verbose = 1;
+			break;
+		case STALL_DETECT_LONG_OPT:
+			stall_thresh_ns = atoll(optarg) * NSEC_PER_USEC;
+			if (!stall_thresh_ns) {
+				fprintf(stderr, "--stall-detect needs a threshold in usecs\n");
+				exit(1);
+			}
+			break;
+		case SEED_LONG_OPT:
+			rng_seed = strtoull(optarg, NULL, 0);
+			rng_seed_set = 1;
+			break;
+		case SERVICE_DIST_LONG_OPT:
+			parse_dist(&service_dist, optarg);
+			break;
+		case SLEEP_DIST_LONG_OPT:
+			parse_dist(&sleep_dist, optarg);
+			break;
+		case STEAL_LONG_OPT:
+			steal = 1;
+			break;
+		case BREAKDOWN_LONG_OPT:
+			breakdown = 1;
+			break;
+		case SCHEDSTAT_LONG_OPT:
+			schedstat = 1;
+			break;
+		case TASK_STATS_LONG_OPT:
+			task_stats = 1;
+			break;
+		case WINDOW_LONG_OPT:
+			window_intervals = atoi(optarg);
+			if (window_intervals < 1) {
+				fprintf(stderr, "--window needs at least one interval\n");
+				exit(1);
+			}
+			break;
+		case JSON_LONG_OPT:
+			output_format = OUTPUT_JSON;
+			break;
+		case CSV_LONG_OPT:
+			output_format = OUTPUT_CSV;
+			break;
+		case HIST_LOG_LONG_OPT:
+			hist_log_path = optarg;
+			break;
+		case HIST_MERGE_LONG_OPT:
+			hist_tool = HIST_TOOL_MERGE;
+			break;
+		case HIST_DIFF_LONG_OPT:
+			hist_tool = HIST_TOOL_DIFF;
+			hist_diff_base = optarg;
+			break;
+		case OUTPUT_FD_LONG_OPT:
+			output_fd = atoi(optarg);
+			if (output_fd < 0 || fcntl(output_fd, F_GETFD) < 0) {
+				fprintf(stderr, "output fd %s is not open\n", optarg);
+				exit(1);
+			}
+			break;
+		case PLACEMENT_LONG_OPT:
+			for (i = PLACEMENT_NONE; placement_names[i]; i++) {
+				if (!strcmp(optarg, placement_names[i]))
+					break;
+			}
+			if (!placement_names[i]) {
+				fprintf(stderr, "unknown placement '%s'\n", optarg);
+				print_usage();
+			}
+			placement = i;
+			break;
+		case WAKE_LONG_OPT:
+			for (i = 0; wake_names[i]; i++) {
+				if (!strcmp(optarg, wake_names[i]))
+					break;
+			}
+			if (!wake_names[i]) {
+				fprintf(stderr, "unknown wake backend '%s'\n", optarg);
+				print_usage();
+			}
+			wake_backend = i;
+			break;
+		case WAKE_FANOUT_LONG_OPT:
+			wake_fanout = atoi(optarg);
+			if (wake_fanout < 0) {
+				fprintf(stderr, "--wake-fanout can't be negative\n");
+				exit(1);
+			}
+			break;
+		case SLO_SEARCH_LONG_OPT:
+			for (i = SEARCH_THREADS; search_names[i]; i++) {
+				if (!strcmp(optarg, search_names[i]))
+					break;
+			}
+			if (!search_names[i]) {
+				fprintf(stderr, "unknown search '%s'\n", optarg);
+				print_usage();
+			}
+			slo_search = i;
+			warmuptime = 0;
+			break;
+		case SLO_LONG_OPT:
+			if (sscanf(optarg, "%lf:%llu", &slo_pct, &slo_usec) != 2 ||
+			    slo_pct <= 0 || slo_pct > 100 || !slo_usec) {
+				fprintf(stderr, "--slo wants percentile:usec, like 99:2000\n");
+				exit(1);
+			}
+			break;
+		case PROBE_TIME_LONG_OPT:
+			probe_time = atoi(optarg);
+			if (probe_time < 1) {
+				fprintf(stderr, "probe time must be at least one second\n");
+				exit(1);
+			}
+			break;
+		case GROUP_LONG_OPT:
+			parse_group(optarg);
+			break;
+		case CGROUP_ROOT_LONG_OPT:
+			cgroup_root = optarg;
+			break;
+		case HOGS_LONG_OPT:
+			parse_hogs(optarg);
+			break;
+		case KERNEL_LONG_OPT:
+			for (i = 0; kernel_names[i]; i++) {
+				if (!strcmp(optarg, kernel_names[i]))
+					break;
+			}
+			if (!kernel_names[i]) {
+				fprintf(stderr, "unknown kernel '%s'\n", optarg);
+				print_usage();
+			}
+			work_kernel = i;
+			break;
+		case PIPE_TRANSPORT_LONG_OPT:
+			for (i = 0; transport_names[i]; i++) {
+				if (!strcmp(optarg, transport_names[i]))
+					break;
+			}
+			if (!transport_names[i]) {
+				fprintf(stderr, "unknown pipe transport '%s'\n", optarg);
+				print_usage();
+			}
+			transport = i;
+			break;
 		case '?':
 		case HELP_LONG_OPT:
 			print_usage();
@@ -241,64 +1188,196 @@ static void parse_options(int ac, char **av)
 	if (found_message_cputime >= 0)
 		message_cputime = message_cputime;
 
-	if (optind < ac) {
-		fprintf(stderr, "Error Extra arguments '%s'\n", av[optind]);
-		exit(1);
+	/*
+	 * groups replace -m.  If any of them has an rps, everyone runs in
+	 * RPS mode and groups without one use -R, so then -R has to be there.
+	 * When they all have one, -R is only the switch into RPS mode
+	 */
+	if (nr_groups) {
+		int with_rps = 0;
+
+		message_threads = 0;
+		for (i = 0; i < nr_groups; i++) {
+			message_threads += groups[i].nr_msg;
+			if (groups[i].rps)
+				with_rps++;
+		}
+		if (with_rps && with_rps < nr_groups && !requests_per_sec) {
+			fprintf(stderr, "groups without rps= run at -R, give -R or an rps= to every group\n");
+			exit(1);
+		}
+		for (i = 0; i < nr_groups && !requests_per_sec; i++)
+			requests_per_sec = groups[i].rps;
 	}
-}
 
-void tvsub(struct timeval * tdiff, struct timeval * t1, struct timeval * t0)
-{
-	tdiff->tv_sec = t1->tv_sec - t0->tv_sec;
-	tdiff->tv_usec = t1->tv_usec - t0->tv_usec;
-	if (tdiff->tv_usec < 0 && tdiff->tv_sec > 0) {
-		tdiff->tv_sec--;
-		tdiff->tv_usec += USEC_PER_SEC;
-		if (tdiff->tv_usec < 0) {
-			fprintf(stderr, "lat_fs: tvsub shows test time ran backwards!\n");
+	/*
+	 * anything that changes between runs will do.  Runs that are meant to
+	 * be random get the seed printed so they can be repeated
+	 */
+	if (!rng_seed_set) {
+		struct timespec ts;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		rng_seed = ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec + getpid();
+		if (!hist_tool && (verbose || service_dist.type != DIST_FIXED ||
+				   sleep_dist.type != DIST_FIXED))
+			fprintf(stderr, "random seed %llu, pass --seed to repeat it\n",
+				rng_seed);
+	}
+
+	/*
+	 * records on stdout would be mixed in with the text report.  They keep
+	 * the real stdout and everything else we print goes to stderr
+	 */
+	if (output_format && output_fd == STDOUT_FILENO) {
+		fflush(stdout);
+		output_fd = dup(STDOUT_FILENO);
+		if (output_fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+			perror("unable to move the report to stderr");
 			exit(1);
 		}
 	}
 
-	/* time shouldn't go backwards!!! */
-	if (tdiff->tv_usec < 0 || t1->tv_sec < t0->tv_sec) {
-		tdiff->tv_sec = 0;
-		tdiff->tv_usec = 0;
+	if (trace_path && (auto_rps || slo_search == SEARCH_RPS)) {
+		fprintf(stderr, "--trace sets its own rate, it can't go with -A or --slo-search rps\n");
+		exit(1);
+	}
+
+	/* the rps search needs RPS mode to start in */
+	if (slo_search == SEARCH_RPS && !requests_per_sec)
+		requests_per_sec = 100;
+
+	if (hist_tool) {
+		hist_files = av + optind;
+		nr_hist_files = ac - optind;
+		if (!nr_hist_files) {
+			fprintf(stderr, "no histogram logs given\n");
+			exit(1);
+		}
+	} else if (optind < ac) {
+		fprintf(stderr, "Error Extra arguments '%s'\n", av[optind]);
+		exit(1);
 	}
 }
 
 /*
- * returns the difference between start and stop in usecs.  Negative values
- * are turned into 0
+ * all of our timestamps are nsecs from CLOCK_MONOTONIC, so they don't jump
+ * around when someone steps the wall clock.  With --tsc we read the TSC
+ * directly and scale it with a mult/shift pair calibrated against
+ * CLOCK_MONOTONIC at startup, which skips the vdso overhead in the hot paths.
  */
-unsigned long long tvdelta(struct timeval *start, struct timeval *stop)
+#if defined(__x86_64__)
+#define HAVE_TSC 1
+static unsigned long long tsc_base;
+static unsigned long long tsc_nsec_base;
+static unsigned long long tsc_mult;
+#define TSC_SHIFT 32
+
+static inline unsigned long long rdtsc(void)
 {
-	struct timeval td;
-	unsigned long long usecs;
+	unsigned int lo, hi;
 
-	tvsub(&td, stop, start);
-	usecs = td.tv_sec;
-	usecs *= USEC_PER_SEC;
-	usecs += td.tv_usec;
-	return (usecs);
+	__asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((unsigned long long)hi << 32) | lo;
 }
+#endif
 
-/* mr axboe's magic latency histogram */
-static unsigned int plat_val_to_idx(unsigned int val)
+static inline unsigned long long clock_nsec(void)
 {
-	unsigned int msb, error_bits, base, offset;
+	struct timespec ts;
 
-	/* Find MSB starting from bit 0 */
-	if (val == 0)
-		msb = 0;
-	else
-		msb = sizeof(val)*8 - __builtin_clz(val) - 1;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
 
-	/*
-	 * MSB <= (PLAT_BITS-1), cannot be rounded off. Use
-	 * all bits of the sample as index
-	 */
-	if (msb <= PLAT_BITS)
+static inline unsigned long long nsec_now(void)
+{
+#ifdef HAVE_TSC
+	if (tsc_mult) {
+		unsigned long long delta = rdtsc() - tsc_base;
+
+		return tsc_nsec_base +
+			(unsigned long long)(((unsigned __int128)delta * tsc_mult) >> TSC_SHIFT);
+	}
+#endif
+	return clock_nsec();
+}
+
+/* cpu time this thread has used, it doesn't count time we were off cpu */
+static unsigned long long thread_cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/*
+ * find the TSC frequency by watching it tick across 50ms of CLOCK_MONOTONIC.
+ * We only do this when the CPU promises an invariant TSC, otherwise the
+ * frequency changes under us and we fall back to clock_gettime.
+ */
+static void calibrate_tsc(void)
+{
+#ifdef HAVE_TSC
+	unsigned int eax, ebx, ecx, edx;
+	unsigned long long tsc_start, tsc_end;
+	unsigned long long ns_start, ns_end;
+
+	__asm__ __volatile__("cpuid"
+			     : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx)
+			     : "a" (0x80000007), "c" (0));
+	if (!(edx & (1 << 8))) {
+		fprintf(stderr, "no invariant TSC, using CLOCK_MONOTONIC\n");
+		return;
+	}
+
+	ns_start = clock_nsec();
+	tsc_start = rdtsc();
+	usleep(50000);
+	ns_end = clock_nsec();
+	tsc_end = rdtsc();
+
+	if (tsc_end <= tsc_start || ns_end <= ns_start) {
+		fprintf(stderr, "TSC calibration failed, using CLOCK_MONOTONIC\n");
+		return;
+	}
+	tsc_mult = ((ns_end - ns_start) << TSC_SHIFT) / (tsc_end - tsc_start);
+	tsc_base = tsc_end;
+	tsc_nsec_base = ns_end;
+#else
+	fprintf(stderr, "no TSC support on this arch, using CLOCK_MONOTONIC\n");
+#endif
+}
+
+/*
+ * returns the difference between start and stop in nsecs.  Different CPUs
+ * may disagree slightly about the TSC, so negative values are turned into 0
+ */
+static inline unsigned long long nsdelta(unsigned long long start,
+					 unsigned long long stop)
+{
+	if (stop < start)
+		return 0;
+	return stop - start;
+}
+
+/* mr axboe's magic latency histogram */
+static unsigned int plat_val_to_idx(unsigned long long val)
+{
+	unsigned int msb, error_bits, base, offset;
+
+	/* Find MSB starting from bit 0 */
+	if (val == 0)
+		msb = 0;
+	else
+		msb = sizeof(val)*8 - __builtin_clzll(val) - 1;
+
+	/*
+	 * MSB <= (PLAT_BITS-1), cannot be rounded off. Use
+	 * all bits of the sample as index
+	 */
+	if (msb <= PLAT_BITS)
 		return val;
 
 	/* Compute the number of error bits to discard*/
@@ -322,9 +1401,10 @@ static unsigned int plat_val_to_idx(unsigned int val)
  * Convert the given index of the bucket array to the value
  * represented by the bucket
  */
-static unsigned int plat_idx_to_val(unsigned int idx)
+static unsigned long long plat_idx_to_val(unsigned int idx)
 {
-	unsigned int error_bits, k, base;
+	unsigned int error_bits, k;
+	unsigned long long base;
 
 	if (idx >= PLAT_NR) {
 		fprintf(stderr, "idx %u is too large\n", idx);
@@ -338,24 +1418,24 @@ static unsigned int plat_idx_to_val(unsigned int idx)
 
 	/* Find the group and compute the minimum value of that group */
 	error_bits = (idx >> PLAT_BITS) - 1;
-	base = 1 << (error_bits + PLAT_BITS);
+	base = 1ULL << (error_bits + PLAT_BITS);
 
 	/* Find its bucket number of the group */
 	k = idx % PLAT_VAL;
 
 	/* Return the mean of the range of the bucket */
-	return base + ((k + 0.5) * (1 << error_bits));
+	return base + ((k + 0.5) * (1ULL << error_bits));
 }
 
 
 static unsigned int calc_percentiles(unsigned int *io_u_plat, unsigned long nr,
-				     unsigned int **output,
+				     unsigned long long **output,
 				     unsigned long **output_counts)
 {
 	unsigned long sum = 0;
 	unsigned int len, i, j = 0;
 	unsigned int oval_len = 0;
-	unsigned int *ovals = NULL;
+	unsigned long long *ovals = NULL;
 	unsigned long *ocounts = NULL;
 	unsigned long last = 0;
 	int is_last;
@@ -367,19 +1447,22 @@ static unsigned int calc_percentiles(unsigned int *io_u_plat, unsigned long nr,
 	if (!len)
 		return 0;
 
+	oval_len = len;
+	ovals = malloc(oval_len * sizeof(unsigned long long));
+	ocounts = malloc(oval_len * sizeof(unsigned long));
+	if (!ovals || !ocounts) {
+		perror("unable to allocate percentiles");
+		exit(1);
+	}
+
 	/*
-	 * Calculate bucket values, note down max and min values
+	 * Calculate bucket values, note down max and min values.  This is one
+	 * pass that stops at the bucket holding the last percentile
 	 */
 	is_last = 0;
 	for (i = 0; i < PLAT_NR && !is_last; i++) {
 		sum += io_u_plat[i];
-		while (sum >= (plist[j] / 100.0 * nr)) {
-			if (j == oval_len) {
-				oval_len += 100;
-				ovals = realloc(ovals, oval_len * sizeof(unsigned int));
-				ocounts = realloc(ocounts, oval_len * sizeof(unsigned long));
-			}
-
+		while (j < oval_len && sum >= (plist[j] / 100.0 * nr)) {
 			ovals[j] = plat_idx_to_val(i);
 			ocounts[j] = sum;
 			is_last = (j == len - 1);
@@ -398,9 +1481,11 @@ static unsigned int calc_percentiles(unsigned int *io_u_plat, unsigned long nr,
 	return len;
 }
 
-static void calc_p99(struct stats *s, int *p95, int *p99)
+/* p95 and p99 come back in nsecs */
+static void calc_p99(struct stats *s, unsigned long long *p95,
+		     unsigned long long *p99)
 {
-	unsigned int *ovals = NULL;
+	unsigned long long *ovals = NULL;
 	unsigned long *ocounts = NULL;
 	int len;
 
@@ -415,763 +1500,5803 @@ static void calc_p99(struct stats *s, int *p95, int *p99)
 		free(ocounts);
 }
 
-static void show_latencies(struct stats *s, unsigned long long runtime)
+/* the --breakdown histograms, in the order show_latencies() prints them */
+static int breakdown_cols[] = { LAT_WAKEUP, LAT_QUEUE, LAT_SERVICE };
+#define NR_BREAKDOWN_COLS (sizeof(breakdown_cols) / sizeof(breakdown_cols[0]))
+
+/*
+ * print the percentiles for s.  If extra is set, it is indexed by LAT_* and
+ * the --breakdown histograms get printed in columns next to the totals.
+ * The wakeup column has one sample per wakeup, the others one per request
+ */
+static void show_latencies(struct stats *s, struct stats *extra,
+			   unsigned long long runtime)
 {
-	unsigned int *ovals = NULL;
+	unsigned long long *ovals = NULL;
 	unsigned long *ocounts = NULL;
-	unsigned int len, i;
+	unsigned long long *cvals[NR_BREAKDOWN_COLS] = { NULL, };
+	unsigned long *ccounts[NR_BREAKDOWN_COLS] = { NULL, };
+	unsigned int clen[NR_BREAKDOWN_COLS] = { 0, };
+	unsigned int len, i, col;
+
+	if (extra) {
+		for (col = 0; col < NR_BREAKDOWN_COLS; col++) {
+			struct stats *c = &extra[breakdown_cols[col]];
+
+			if (c->nr_samples)
+				clen[col] = calc_percentiles(c->plat, c->nr_samples,
+							     &cvals[col], &ccounts[col]);
+		}
+	}
 
 	len = calc_percentiles(s->plat, s->nr_samples, &ovals, &ocounts);
 	if (len) {
-		fprintf(stderr, "Latency percentiles (usec) runtime %llu (s) (%lu total samples)\n", runtime, s->nr_samples);
-		for (i = 0; i < len; i++)
-			fprintf(stderr, "\t%s%2.1fth: %-10u (%lu samples)\n",
+		fprintf(stderr, "Latency percentiles (%s) runtime %llu (s) (%lu total samples)",
+			report_units, runtime, s->nr_samples);
+		for (col = 0; extra && col < NR_BREAKDOWN_COLS; col++)
+			fprintf(stderr, "  %-10s", lat_stats_names[breakdown_cols[col]]);
+		fprintf(stderr, "\n");
+		for (i = 0; i < len; i++) {
+			fprintf(stderr, "\t%s%2.1fth: %-10llu (%lu samples)",
 				i == PLIST_P99 ? "* " : "  ",
-				plist[i], ovals[i], ocounts[i]);
+				plist[i], ovals[i] / report_div, ocounts[i]);
+			for (col = 0; extra && col < NR_BREAKDOWN_COLS; col++) {
+				if (i < clen[col])
+					fprintf(stderr, "  %-10llu", cvals[col][i] / report_div);
+				else
+					fprintf(stderr, "  %-10s", "-");
+			}
+			fprintf(stderr, "\n");
+		}
 	}
 
 	if (ovals)
 		free(ovals);
 	if (ocounts)
 		free(ocounts);
+	for (col = 0; col < NR_BREAKDOWN_COLS; col++) {
+		free(cvals[col]);
+		free(ccounts[col]);
+	}
+
+	fprintf(stderr, "\t  min=%llu, max=%llu\n", s->min / report_div,
+		s->max / report_div);
+}
+
+/* gcc turns adds of these into whatever vector instructions we have */
+typedef unsigned int vuint __attribute__((vector_size(8 * sizeof(unsigned int))));
+#define VUINT_LEN (sizeof(vuint) / sizeof(unsigned int))
+
+#if PLAT_NR % 8
+#error PLAT_NR has to be a multiple of the vuint length
+#endif
+
+/* the used part of s->plat, widened out to whole vuints */
+static void stats_range(struct stats *s, unsigned int *lo, unsigned int *hi)
+{
+	if (!s->hi) {
+		*lo = 0;
+		*hi = 0;
+		return;
+	}
+	*lo = s->lo & ~(VUINT_LEN - 1);
+	*hi = (s->hi + VUINT_LEN - 1) & ~(VUINT_LEN - 1);
+}
 
-	fprintf(stderr, "\t  min=%u, max=%u\n", s->min, s->max);
+/* note that bucket idx is in use */
+static void stats_mark(struct stats *s, unsigned int idx)
+{
+	if (!s->hi) {
+		s->lo = idx;
+		s->hi = idx + 1;
+	} else if (idx < s->lo) {
+		s->lo = idx;
+	} else if (idx >= s->hi) {
+		s->hi = idx + 1;
+	}
 }
 
 /* fold latency info from s into d */
 void combine_stats(struct stats *d, struct stats *s)
 {
-	int i;
-	for (i = 0; i < PLAT_NR; i++)
-		d->plat[i] += s->plat[i];
+	unsigned int lo, hi, i;
+	vuint a, b;
+
+	stats_range(s, &lo, &hi);
+	for (i = lo; i < hi; i += VUINT_LEN) {
+		memcpy(&a, d->plat + i, sizeof(a));
+		memcpy(&b, s->plat + i, sizeof(b));
+		a += b;
+		memcpy(d->plat + i, &a, sizeof(a));
+	}
+	if (s->hi) {
+		stats_mark(d, s->lo);
+		stats_mark(d, s->hi - 1);
+	}
 	d->nr_samples += s->nr_samples;
 	if (s->max > d->max)
 		d->max = s->max;
-	if (d->min == 0 || s->min < d->min)
+	if (s->min && (d->min == 0 || s->min < d->min))
 		d->min = s->min;
 }
 
-/* record a latency result into the histogram */
-static void add_lat(struct stats *s, unsigned int us)
+/*
+ * take the samples in s out of d.  Histograms only ever grow, so this is
+ * how we get the latencies recorded since s was snapshotted.  min and max
+ * can't be subtracted, callers have to track those separately
+ */
+static void subtract_stats(struct stats *d, struct stats *s)
 {
-	int lat_index = 0;
-
-	if (!matrix_size) {
-		if (us > cputime)
-			us -= cputime;
-		else
-			us = 1;
+	unsigned int lo, hi, i;
+	vuint a, b;
+
+	/* s was a snapshot of d, so its range is inside d's */
+	stats_range(s, &lo, &hi);
+	for (i = lo; i < hi; i += VUINT_LEN) {
+		memcpy(&a, d->plat + i, sizeof(a));
+		memcpy(&b, s->plat + i, sizeof(b));
+		a -= b;
+		memcpy(d->plat + i, &a, sizeof(a));
 	}
+	d->nr_samples -= s->nr_samples;
+}
+
+/*
+ * record a latency result (in nsecs) into the histogram.  Only the owning
+ * thread writes to its histogram, so these are plain increments and readers
+ * use the thread's stats_seq to get a consistent copy
+ */
+static void add_lat(struct stats *s, unsigned long long ns)
+{
+	int lat_index = 0;
 
-	if (us > s->max)
-		s->max = us;
-	if (s->min == 0 || us < s->min)
-		s->min = us;
+	if (ns > s->max)
+		s->max = ns;
+	if (s->min == 0 || ns < s->min)
+		s->min = ns;
 
-	lat_index = plat_val_to_idx(us);
-	__sync_fetch_and_add(&s->plat[lat_index], 1);
-	__sync_fetch_and_add(&s->nr_samples, 1);
+	lat_index = plat_val_to_idx(ns);
+	s->plat[lat_index]++;
+	stats_mark(s, lat_index);
+	s->nr_samples++;
 }
 
 struct request {
-	struct timeval start_time;
+	/* the worker whose pool we came from */
+	struct thread_data *owner;
+	/* nsec timestamp from when the request was queued */
+	unsigned long long start_time;
+	/* the CPU the dispatcher was on when it queued us */
+	int wake_cpu;
+	/*
+	 * when the request was supposed to arrive.  The paced dispatcher
+	 * stamps its schedule in here, so if the dispatcher itself runs late
+	 * that delay is still charged to the request
+	 */
+	unsigned long long intended_time;
+	/* --trace usecs of work and class, class is -1 for -c or -n work */
+	unsigned long long service;
+	int class;
 	struct request *next;
 };
 
 /*
- * every thread has one of these, it comes out to about 19K thanks to the
- * giant stats struct
+ * with --steal each worker's requests go into one of these instead of the
+ * ->request list.  It's a Chase-Lev style ring, except the dispatcher is
+ * the only one pushing at the bottom and everyone (the worker itself
+ * included) takes from the top with a cmpxchg.  That keeps each worker's
+ * queue FIFO and lets idle workers take requests from a worker that was
+ * preempted before it could get to them.
+ *
+ * A worker never has more than request_pool_size requests outstanding, so
+ * sizing the ring to the pool means the dispatcher can't overrun it.
+ */
+struct request_deque {
+	long top;
+	long bottom;
+	unsigned long mask;
+	struct request **slots;
+};
+
+/*
+ * the futex word is always the state machine that says if a thread is
+ * blocked.  The --wake backend only decides how it sleeps and how it
+ * gets kicked out of that sleep
+ */
+struct waker {
+	/* eventfd, or the read side of the pipe */
+	int fd;
+	/* write side of the pipe */
+	int wfd;
+	int epfd;
+	struct wake_ring *ring;
+	/*
+	 * futex-waitv, a message thread bumps this to wake every worker it
+	 * marked runnable with one FUTEX_WAKE.  Its workers wait on it too
+	 */
+	unsigned int batch;
+};
+
+/*
+ * -p mode channels between a worker and its message thread.  The worker
+ * writes to CHAN_UP_WRITE and reads CHAN_DOWN_READ, the message thread
+ * has the other two.  A socketpair uses the same fd for both directions
+ */
+enum {
+	CHAN_UP_READ = 0,
+	CHAN_UP_WRITE,
+	CHAN_DOWN_READ,
+	CHAN_DOWN_WRITE,
+	NR_CHAN_FDS,
+};
+
+enum {
+	RING_UP = 0,
+	RING_DOWN,
+	NR_RINGS,
+};
+
+/*
+ * what the kernel accounted for one thread.  run and wait come from
+ * /proc/self/task/<tid>/schedstat and are zero if it isn't there
+ */
+struct task_sample {
+	unsigned long long run_ns;
+	unsigned long long wait_ns;
+	unsigned long long timeslices;
+	unsigned long long migrations;
+	unsigned long long involuntary;
+};
+
+/*
+ * every thread has one of these.  The array of them is mmap'd, ->stats
+ * makes each one a whole number of pages, and a worker fills in its own
+ * before anyone else touches it (see worker_setup()).  So the pages end
+ * up on whatever node the worker runs on.  The fields other threads
+ * write get cachelines of their own
  */
 struct thread_data {
-	pthread_t tid;
+	/*
+	 * the wakeup line.  The msg thread stuffs a nsec timestamp in
+	 * ->wake_time before waking us, so we can measure scheduler latency
+	 */
+	int futex __attribute__((aligned(CACHELINE_SIZE)));
+	/* the CPU our waker was on, for --placement locality stats */
+	int wake_cpu;
+	unsigned long long wake_time;
 	/* ->next is for placing us on the msg_thread's list for waking */
 	struct thread_data *next;
-
 	/* ->request is all of our pending request */
 	struct request *request;
-
-	/* our parent thread and messaging partner */
-	struct thread_data *msg_thread;
+	/* --wake-fanout, the workers we have to wake once we're up */
+	struct thread_data *wake_chain;
+	/* whatever the --wake backend blocks on when the futex says to */
+	struct waker waker;
 
 	/*
-	 * the msg thread stuffs gtod in here before waking us, so we can
-	 * measure scheduler latency
+	 * RPS mode requests come out of a preallocated pool so the dispatcher
+	 * never has to malloc and we never free across threads.  Finished
+	 * requests are pushed onto ->free_requests by the worker, and the
+	 * dispatcher splices them over to ->free_cache in batches.
 	 */
-	struct timeval wake_time;
+	struct request *free_requests __attribute__((aligned(CACHELINE_SIZE)));
+	struct request *free_cache;
+	struct request *request_pool;
+	/* requests dropped because every request in our pool was in flight */
+	unsigned long pool_exhausted;
+	/* paced dispatchers, arrivals that had to wait for a free request */
+	unsigned long backlogged;
+	/*
+	 * paced dispatchers, arrivals dropped because the backlog was full
+	 * or still held them at the end.  No worker's pool is to blame
+	 */
+	unsigned long backlog_dropped;
 
-	/* keep the futex and the wake_time in the same cacheline */
-	int futex;
+	/* --steal mode request queue, and how many requests we took from others */
+	struct request_deque deque __attribute__((aligned(CACHELINE_SIZE)));
+	unsigned long steals;
 
-	/* mr axboe's magic latency histogram */
-	struct stats stats;
+	/* from here down it's set up as we start, or only we write it */
+	pthread_t tid __attribute__((aligned(CACHELINE_SIZE)));
+	/* our parent thread and messaging partner */
+	struct thread_data *msg_thread;
+
+	/* --group we belong to, or NULL */
+	struct worker_group *group;
+	/* usecs of -c for us, groups can have their own */
+	unsigned long long cputime;
+	/* usecs we actually spun for the last request, -c after --service-dist */
+	unsigned long long spin;
+	/* which message thread we belong to */
+	int msg_index;
+
+	/* how many threads we posted, and the nsecs it took us */
+	unsigned long wakes;
+	unsigned long long wake_cost;
+
+	/* our kernel tid, and the --task-stats sample from the last interval */
+	pid_t task_id;
+	struct task_sample task_last;
+	int task_valid;
+	/* migrations since the stats were zeroed */
+	unsigned long long task_migrations;
+
+	/* -p bytes, only allocated in pipe mode, by the thread that owns it */
+	char *pipe_page;
+	/* the --pipe-transport channel to our message thread */
+	int chan[NR_CHAN_FDS];
+	struct shm_ring *ring[NR_RINGS];
+
+	/* the --kernel working set, matrices to multiply by default */
+	void *data;
+	/* where the chase kernel left off */
+	void *kernel_pos;
+	/* our PRNG state, see rng_next() */
+	uint64_t rng;
+	/* results go here so the compiler can't throw the work away */
+	unsigned long kernel_sink;
+
+	/* odd while we're updating ->lat_stats, see stats_write_begin() */
+	unsigned int stats_seq __attribute__((aligned(CACHELINE_SIZE)));
+	/* the stats_epoch our min/max were recorded in */
+	unsigned long stats_epoch;
 	unsigned long long loop_count;
+	/* nsecs */
 	unsigned long long runtime;
-	unsigned long pending;
+	/* [LAT_TOTAL] is &stats, the rest are NULL unless they're recorded */
+	struct stats *lat_stats[NR_LAT_STATS];
 
-	char pipe_page[PIPE_TRANSFER_BUFFER];
-
-	/* matrices to multiply */
-	unsigned long *data;
+	/* mr axboe's magic latency histogram, starting on a page of its own */
+	struct stats stats __attribute__((aligned(THREAD_STATS_ALIGN)));
 };
 
-/* we're so fancy we make our own futex wrappers */
-#define FUTEX_BLOCKED 0
-#define FUTEX_RUNNING 1
-
-static int futex(int *uaddr, int futex_op, int val,
-		 const struct timespec *timeout, int *uaddr2, int val3)
-{
-	return syscall(SYS_futex, uaddr, futex_op, val, timeout, uaddr2, val3);
-}
+#if defined(__x86_64__) || defined(__i386__)
+#define nop __asm__ __volatile__("rep;nop": : :"memory")
+#elif defined(__aarch64__)
+#define nop __asm__ __volatile__("yield" ::: "memory")
+#elif defined(__powerpc64__)
+#define nop __asm__ __volatile__("nop": : :"memory")
+#else
+#error Unsupported architecture
+#endif
 
 /*
- * wakeup a process waiting on a futex, making sure they are really waiting
- * first
+ * ->stats is only written by its own thread and nothing else ever zeros it,
+ * so the reporter never races with add_lat() on a counter.  It does need a
+ * consistent copy though, so writers bump ->stats_seq to an odd value while
+ * they work and back to even when they're done.  These are just compiler
+ * barriers on x86, which is the whole point, there are no locked
+ * instructions on the recording side.
  */
-static void fpost(int *futexp)
+static inline void stats_write_begin(struct thread_data *td)
 {
-	int s;
+	int i;
 
-	if (__sync_bool_compare_and_swap(futexp, FUTEX_BLOCKED,
-					 FUTEX_RUNNING)) {
-		s = futex(futexp, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
-		if (s  == -1) {
-			perror("FUTEX_WAKE");
-			exit(1);
+	__atomic_store_n(&td->stats_seq, td->stats_seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	/* the reporter zeroed the stats, start min/max over */
+	if (td->stats_epoch != stats_epoch) {
+		td->stats_epoch = stats_epoch;
+		for (i = 0; i < NR_LAT_STATS; i++) {
+			if (td->lat_stats[i]) {
+				td->lat_stats[i]->min = 0;
+				td->lat_stats[i]->max = 0;
+			}
 		}
 	}
 }
 
-/*
- * wait on a futex, with an optional timeout.  Make sure to set
- * the futex to FUTEX_BLOCKED beforehand.
- *
- * This will return zero if all went well, or return -ETIMEDOUT if you
- * hit the timeout without getting posted
- */
-static int fwait(int *futexp, struct timespec *timeout)
+static inline void stats_write_end(struct thread_data *td)
 {
-	int s;
-	while (1) {
-		/* Is the futex available? */
-		if (__sync_bool_compare_and_swap(futexp, FUTEX_RUNNING,
-						 FUTEX_BLOCKED)) {
-			break;      /* Yes */
-		}
-		/* Futex is not available; wait */
-		s = futex(futexp, FUTEX_WAIT_PRIVATE, FUTEX_BLOCKED, timeout, NULL, 0);
-		if (s == -1 && errno != EAGAIN) {
-			if (errno == ETIMEDOUT)
-				return -ETIMEDOUT;
-			perror("futex-FUTEX_WAIT");
-			exit(1);
-		}
-	}
-	return 0;
+	__atomic_store_n(&td->stats_seq, td->stats_seq + 1, __ATOMIC_RELEASE);
 }
 
 /*
- * cmpxchg based list prepend
+ * the usecs of spinning on purpose behind a sample, which isn't latency.
+ * That's the request's own service time for --trace, and the -c we drew
+ * unless we're doing real -n work
  */
-static void xlist_add(struct thread_data *head, struct thread_data *add)
+static unsigned long long spin_usecs(struct thread_data *td, struct request *req)
 {
-	struct thread_data *old;
-	struct thread_data *ret;
-
-	while (1) {
-		old = head->next;
-		add->next = old;
-		ret = __sync_val_compare_and_swap(&head->next, old, add);
-		if (ret == old)
-			break;
-	}
+	if (req && req->class >= 0)
+		return req->service;
+	return operations ? 0 : td->spin;
 }
 
 /*
- * xchg based list splicing.  This returns the entire list and
- * replaces the head->next with NULL
+ * record a latency sample for this thread, with the spin usecs taken back
+ * out.
+ *
+ * locality is one of the LAT_SAME_CORE..LAT_CROSS_NODE classes, or -1 if
+ * we're not sorting wakeups by where they came from
  */
-static struct thread_data *xlist_splice(struct thread_data *head)
+static void record_lat(struct thread_data *td, unsigned long long ns,
+		       unsigned long long spin, int locality)
 {
-	struct thread_data *old;
-	struct thread_data *ret;
+	if (ns > spin * NSEC_PER_USEC)
+		ns -= spin * NSEC_PER_USEC;
+	else
+		ns = 1;
 
-	while (1) {
-		old = head->next;
-		ret = __sync_val_compare_and_swap(&head->next, old, NULL);
-		if (ret == old)
-			break;
-	}
-	return ret;
+	stats_write_begin(td);
+	add_lat(&td->stats, ns);
+	if (locality >= 0 && td->lat_stats[locality])
+		add_lat(td->lat_stats[locality], ns);
+	stats_write_end(td);
 }
 
-/*
- * cmpxchg based list prepend
- */
-static struct request *request_add(struct thread_data *head, struct request *add)
+/* record a raw sample into one of the optional histograms, if it's on */
+static void record_extra_lat(struct thread_data *td, int which,
+			     unsigned long long ns)
 {
-	struct request *old;
-	struct request *ret;
-
-	while (1) {
-		old = head->request;
-		add->next = old;
-		ret = __sync_val_compare_and_swap(&head->request, old, add);
-		if (ret == old)
-			return old;
-	}
+	if (!td->lat_stats[which])
+		return;
+	stats_write_begin(td);
+	add_lat(td->lat_stats[which], ns);
+	stats_write_end(td);
 }
 
 /*
- * xchg based list splicing.  This returns the entire list and
- * replaces the head->request with NULL.  The list is reversed before
- * returning
+ * paced dispatchers, how late an arrival went out.  It goes in the message
+ * thread's own ->stats under the same seqlock as everyone else's samples
  */
-static struct request *request_splice(struct thread_data *head)
+static void record_pacer_lag(struct thread_data *td, unsigned long long ns)
 {
-	struct request *old;
-	struct request *ret;
-	struct request *reverse = NULL;
-
-	while (1) {
-		old = head->request;
-		ret = __sync_val_compare_and_swap(&head->request, old, NULL);
-		if (ret == old)
-			break;
-	}
+	stats_write_begin(td);
+	add_lat(&td->stats, ns);
+	stats_write_end(td);
+}
 
-	while(ret) {
-		struct request *tmp = ret;
-		ret = ret->next;
-		tmp->next = reverse;
-		reverse = tmp;
+static void alloc_lat_stats(struct thread_data *td, int which)
+{
+	td->lat_stats[which] = calloc(1, sizeof(struct stats));
+	if (!td->lat_stats[which]) {
+		perror("unable to allocate stats");
+		exit(1);
 	}
-	return reverse;
 }
 
-static struct request *allocate_request(void)
+static void free_lat_stats(struct thread_data *td)
 {
-	struct request *ret = malloc(sizeof(*ret));
+	int i;
 
-	if (!ret) {
-		perror("malloc");
-		exit(1);
+	for (i = LAT_TOTAL + 1; i < NR_LAT_STATS; i++) {
+		free(td->lat_stats[i]);
+		td->lat_stats[i] = NULL;
 	}
-
-	gettimeofday(&ret->start_time, NULL);
-	ret->next = NULL;
-	return ret;
 }
 
+/* how many times the reporter retries a snapshot before giving up */
+#define STATS_SNAPSHOT_TRIES 64
 
 /*
- * Wake everyone currently waiting on the message list, filling in their
- * thread_data->wake_time with the current time.
- *
- * It's not exactly the current time, it's really the time at the start of
- * the list run.  We want to detect when the scheduler is just preempting the
- * waker and giving away the rest of its timeslice.  So we gtod once at
- * the start of the loop and use that for all the threads we wake.
+ * copy a thread's histogram into dst while it is still recording.  If the
+ * writer keeps getting in the way we take the copy anyway.  Every counter only
+ * goes up, so samples we miss this time get picked up by the next snapshot,
+ * we just recount nr_samples so it matches the buckets we did copy.
  *
- * Since pipe mode ends up measuring this other ways, we do the gtod
- * every time in pipe mode
+ * min and max are only valid for the current stats_epoch, they are zeroed
+ * in the copy if the thread hasn't recorded anything since the last reset.
  */
-static void xlist_wake_all(struct thread_data *td)
+static void snapshot_stats(struct thread_data *td, int which,
+			   struct stats *dst)
 {
-	struct thread_data *list;
-	struct thread_data *next;
-	struct timeval now;
+	struct stats *src = td->lat_stats[which];
+	unsigned long epoch;
+	unsigned int seq;
+	unsigned int lo, hi;
+	int tries = 0;
+	unsigned int i;
 
-	list = xlist_splice(td);
-	gettimeofday(&now, NULL);
-	while (list) {
-		next = list->next;
-		list->next = NULL;
-		if (pipe_test) {
-			memset(list->pipe_page, 1, pipe_test);
-			gettimeofday(&list->wake_time, NULL);
-		} else {
-			memcpy(&list->wake_time, &now, sizeof(now));
+	/*
+	 * only the used range of plat[] gets copied, dst is garbage outside
+	 * of it.  combine_stats() and friends never look out there
+	 */
+	while (1) {
+		seq = __atomic_load_n(&td->stats_seq, __ATOMIC_ACQUIRE);
+		dst->nr_samples = src->nr_samples;
+		dst->min = src->min;
+		dst->max = src->max;
+		dst->lo = src->lo;
+		dst->hi = src->hi;
+		stats_range(dst, &lo, &hi);
+		memcpy(dst->plat + lo, src->plat + lo, (hi - lo) * sizeof(dst->plat[0]));
+		epoch = td->stats_epoch;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (!(seq & 1) &&
+		    seq == __atomic_load_n(&td->stats_seq, __ATOMIC_RELAXED))
+			break;
+		if (++tries >= STATS_SNAPSHOT_TRIES) {
+			dst->nr_samples = 0;
+			for (i = lo; i < hi; i++)
+				dst->nr_samples += dst->plat[i];
+			break;
 		}
-		fpost(&list->futex);
-		list = next;
+		nop;
+	}
+	if (epoch != stats_epoch) {
+		dst->min = 0;
+		dst->max = 0;
 	}
 }
 
-/*
+/* we're so fancy we make our own futex wrappers */
+#define FUTEX_BLOCKED 0
+#define FUTEX_RUNNING 1
+
+static int futex(int *uaddr, int futex_op, int val,
+		 const struct timespec *timeout, int *uaddr2, int val3)
+{
+	return syscall(SYS_futex, uaddr, futex_op, val, timeout, uaddr2, val3);
+}
+
+#ifndef SYS_futex_waitv
+#define SYS_futex_waitv 449
+#endif
+#ifndef SYS_io_uring_setup
+#define SYS_io_uring_setup 425
+#endif
+#ifndef SYS_io_uring_enter
+#define SYS_io_uring_enter 426
+#endif
+
+/*
+ * every blocked futex_waitv waiter also waits on this, so shutdown can
+ * kick all of them with one FUTEX_WAKE
+ */
+static int wake_stop_futex;
+
+/* one io_uring per thread, used to poll its eventfd */
+struct wake_ring {
+	int fd;
+	void *sq_ptr;
+	size_t sq_len;
+	void *cq_ptr;
+	size_t cq_len;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+struct wake_ops {
+	void (*init)(struct thread_data *td);
+	void (*block)(struct thread_data *td);
+	void (*kick)(struct thread_data *td);
+	void (*cleanup)(struct thread_data *td);
+	/* optional, wakes every blocked thread at shutdown */
+	void (*broadcast)(void);
+	/*
+	 * optional, wakes every worker the waker marked with fmark() in one
+	 * go.  Without it each one gets its own kick
+	 */
+	void (*kick_batch)(struct thread_data *waker);
+};
+
+static void futex_block(struct thread_data *td)
+{
+	int s;
+
+	s = futex(&td->futex, FUTEX_WAIT_PRIVATE, FUTEX_BLOCKED, NULL, NULL, 0);
+	if (s == -1 && errno != EAGAIN && errno != EINTR) {
+		perror("futex-FUTEX_WAIT");
+		exit(1);
+	}
+}
+
+static void futex_kick(struct thread_data *td)
+{
+	int s;
+
+	s = futex(&td->futex, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	if (s  == -1) {
+		perror("FUTEX_WAKE");
+		exit(1);
+	}
+}
+
+static void eventfd_init_flags(struct thread_data *td, int flags)
+{
+	td->waker.fd = eventfd(0, flags);
+	if (td->waker.fd < 0) {
+		perror("eventfd");
+		exit(1);
+	}
+}
+
+static void eventfd_init(struct thread_data *td)
+{
+	eventfd_init_flags(td, 0);
+}
+
+/* reads reset the eventfd counter, so kicks that pile up fold together */
+static void eventfd_block(struct thread_data *td)
+{
+	uint64_t val;
+
+	if (read(td->waker.fd, &val, sizeof(val)) < 0 &&
+	    errno != EAGAIN && errno != EINTR) {
+		perror("eventfd read");
+		exit(1);
+	}
+}
+
+static void eventfd_kick(struct thread_data *td)
+{
+	uint64_t val = 1;
+
+	if (write(td->waker.fd, &val, sizeof(val)) < 0) {
+		perror("eventfd write");
+		exit(1);
+	}
+}
+
+static void fd_cleanup(struct thread_data *td)
+{
+	close(td->waker.fd);
+	if (td->waker.wfd >= 0)
+		close(td->waker.wfd);
+	if (td->waker.epfd >= 0)
+		close(td->waker.epfd);
+}
+
+static void pipe_init(struct thread_data *td)
+{
+	int fds[2];
+
+	if (pipe(fds) < 0) {
+		perror("pipe");
+		exit(1);
+	}
+	td->waker.fd = fds[0];
+	td->waker.wfd = fds[1];
+}
+
+static void pipe_block(struct thread_data *td)
+{
+	char buf[64];
+
+	if (read(td->waker.fd, buf, sizeof(buf)) < 0 && errno != EINTR) {
+		perror("pipe read");
+		exit(1);
+	}
+}
+
+static void pipe_kick(struct thread_data *td)
+{
+	char c = 0;
+
+	if (write(td->waker.wfd, &c, 1) < 0) {
+		perror("pipe write");
+		exit(1);
+	}
+}
+
+static void epoll_init(struct thread_data *td)
+{
+	struct epoll_event ev;
+
+	eventfd_init_flags(td, EFD_NONBLOCK);
+	td->waker.epfd = epoll_create1(0);
+	if (td->waker.epfd < 0) {
+		perror("epoll_create1");
+		exit(1);
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	if (epoll_ctl(td->waker.epfd, EPOLL_CTL_ADD, td->waker.fd, &ev) < 0) {
+		perror("epoll_ctl");
+		exit(1);
+	}
+}
+
+static void epoll_block(struct thread_data *td)
+{
+	struct epoll_event ev;
+
+	if (epoll_wait(td->waker.epfd, &ev, 1, -1) < 0 && errno != EINTR) {
+		perror("epoll_wait");
+		exit(1);
+	}
+	eventfd_block(td);
+}
+
+static void futex_waitv_init(struct thread_data *td)
+{
+	struct futex_waitv w;
+
+	/* find out now if the kernel is too old, not in the middle of a run */
+	memset(&w, 0, sizeof(w));
+	w.uaddr = (unsigned long)&td->futex;
+	w.val = FUTEX_BLOCKED + 1;
+	w.flags = FUTEX_32 | FUTEX_PRIVATE_FLAG;
+	if (syscall(SYS_futex_waitv, &w, 1, 0, NULL, 0) < 0 && errno == ENOSYS) {
+		perror("futex_waitv");
+		exit(1);
+	}
+}
+
+/*
+ * wait on our own futex, the shutdown word and, for workers, our message
+ * thread's batch word.  The batch is read before our futex is checked,
+ * and the waker marks our futex before it bumps the batch, so a wake
+ * can't slip in between.  A batch wakes every worker of that message
+ * thread, the ones that weren't marked go back to sleep in fwait()
+ */
+static void futex_waitv_block(struct thread_data *td)
+{
+	struct futex_waitv w[3];
+	int nr = 2;
+	int s;
+
+	memset(w, 0, sizeof(w));
+	w[0].uaddr = (unsigned long)&td->futex;
+	w[0].val = FUTEX_BLOCKED;
+	w[0].flags = FUTEX_32 | FUTEX_PRIVATE_FLAG;
+	w[1].uaddr = (unsigned long)&wake_stop_futex;
+	w[1].val = 0;
+	w[1].flags = FUTEX_32 | FUTEX_PRIVATE_FLAG;
+	if (td->msg_thread) {
+		w[2].uaddr = (unsigned long)&td->msg_thread->waker.batch;
+		w[2].val = __atomic_load_n(&td->msg_thread->waker.batch,
+					   __ATOMIC_SEQ_CST);
+		w[2].flags = FUTEX_32 | FUTEX_PRIVATE_FLAG;
+		nr++;
+	}
+	s = syscall(SYS_futex_waitv, w, nr, 0, NULL, 0);
+	if (s < 0 && errno != EAGAIN && errno != EINTR) {
+		perror("futex_waitv");
+		exit(1);
+	}
+}
+
+static void futex_waitv_broadcast(void)
+{
+	__atomic_store_n(&wake_stop_futex, 1, __ATOMIC_SEQ_CST);
+	futex(&wake_stop_futex, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static void futex_waitv_kick_batch(struct thread_data *waker)
+{
+	__atomic_add_fetch(&waker->waker.batch, 1, __ATOMIC_SEQ_CST);
+	futex((int *)&waker->waker.batch, FUTEX_WAKE_PRIVATE, INT_MAX, NULL,
+	      NULL, 0);
+}
+
+static void *ring_mmap(int fd, size_t len, off_t off)
+{
+	void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, fd, off);
+	if (p == MAP_FAILED) {
+		perror("io_uring mmap");
+		exit(1);
+	}
+	return p;
+}
+
+/* no liburing here, just enough raw ring handling to poll one fd */
+static void io_uring_init(struct thread_data *td)
+{
+	struct io_uring_params p;
+	struct wake_ring *ring;
+
+	eventfd_init_flags(td, EFD_NONBLOCK);
+	ring = calloc(1, sizeof(*ring));
+	if (!ring) {
+		perror("calloc");
+		exit(1);
+	}
+	memset(&p, 0, sizeof(p));
+	ring->fd = syscall(SYS_io_uring_setup, 4, &p);
+	if (ring->fd < 0) {
+		perror("io_uring_setup");
+		exit(1);
+	}
+	ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_len > ring->sq_len)
+			ring->sq_len = ring->cq_len;
+		ring->sq_ptr = ring_mmap(ring->fd, ring->sq_len, IORING_OFF_SQ_RING);
+		ring->cq_ptr = ring->sq_ptr;
+	} else {
+		ring->sq_ptr = ring_mmap(ring->fd, ring->sq_len, IORING_OFF_SQ_RING);
+		ring->cq_ptr = ring_mmap(ring->fd, ring->cq_len, IORING_OFF_CQ_RING);
+	}
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = ring_mmap(ring->fd, ring->sqes_len, IORING_OFF_SQES);
+
+	ring->sq_tail = ring->sq_ptr + p.sq_off.tail;
+	ring->sq_mask = ring->sq_ptr + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ptr + p.sq_off.array;
+	ring->cq_head = ring->cq_ptr + p.cq_off.head;
+	ring->cq_tail = ring->cq_ptr + p.cq_off.tail;
+	ring->cq_mask = ring->cq_ptr + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_ptr + p.cq_off.cqes;
+	td->waker.ring = ring;
+}
+
+/*
+ * one shot IORING_OP_POLL_ADD on our eventfd, submitted and waited for
+ * in a single io_uring_enter
+ */
+static void io_uring_block(struct thread_data *td)
+{
+	struct wake_ring *ring = td->waker.ring;
+	struct io_uring_sqe *sqe;
+	unsigned tail = *ring->sq_tail;
+	unsigned idx = tail & *ring->sq_mask;
+	unsigned head;
+	unsigned to_submit = 1;
+	int ret;
+
+	sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = td->waker.fd;
+	sqe->poll32_events = POLLIN;
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	while (1) {
+		head = *ring->cq_head;
+		if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+			break;
+		ret = syscall(SYS_io_uring_enter, ring->fd, to_submit, 1,
+			      IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0 && errno != EINTR) {
+			perror("io_uring_enter");
+			exit(1);
+		}
+		if (ret >= 0)
+			to_submit = 0;
+	}
+	if (ring->cqes[head & *ring->cq_mask].res < 0) {
+		errno = -ring->cqes[head & *ring->cq_mask].res;
+		perror("io_uring poll");
+		exit(1);
+	}
+	__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+	eventfd_block(td);
+}
+
+static void io_uring_cleanup(struct thread_data *td)
+{
+	struct wake_ring *ring = td->waker.ring;
+
+	munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_len);
+	munmap(ring->sq_ptr, ring->sq_len);
+	close(ring->fd);
+	free(ring);
+	td->waker.ring = NULL;
+	fd_cleanup(td);
+}
+
+static struct wake_ops wake_ops[] = {
+	[WAKE_FUTEX] = { NULL, futex_block, futex_kick, NULL, NULL, NULL },
+	[WAKE_EVENTFD] = { eventfd_init, eventfd_block, eventfd_kick, fd_cleanup,
+			   NULL, NULL },
+	[WAKE_PIPE] = { pipe_init, pipe_block, pipe_kick, fd_cleanup, NULL, NULL },
+	[WAKE_EPOLL] = { epoll_init, epoll_block, eventfd_kick, fd_cleanup,
+			 NULL, NULL },
+	[WAKE_FUTEX_WAITV] = { futex_waitv_init, futex_waitv_block, futex_kick,
+			       NULL, futex_waitv_broadcast,
+			       futex_waitv_kick_batch },
+	[WAKE_IO_URING] = { io_uring_init, io_uring_block, eventfd_kick,
+			    io_uring_cleanup, NULL, NULL },
+};
+
+/* set up the --wake backend for td, before anyone can post it */
+static void wake_init(struct thread_data *td)
+{
+	td->waker.fd = -1;
+	td->waker.wfd = -1;
+	td->waker.epfd = -1;
+	td->waker.ring = NULL;
+	td->waker.batch = 0;
+	if (wake_ops[wake_backend].init)
+		wake_ops[wake_backend].init(td);
+}
+
+/* once nobody can post td anymore */
+static void wake_cleanup(struct thread_data *td)
+{
+	if (wake_ops[wake_backend].cleanup)
+		wake_ops[wake_backend].cleanup(td);
+}
+
+/*
+ * wakeup a thread waiting on its futex, making sure they are really waiting
+ * first
+ */
+static void fpost(struct thread_data *td)
+{
+	if (__sync_bool_compare_and_swap(&td->futex, FUTEX_BLOCKED,
+					 FUTEX_RUNNING))
+		wake_ops[wake_backend].kick(td);
+}
+
+/*
+ * the first half of fpost(), for backends with a ->kick_batch.  Returns
+ * true if td was waiting and the batch has to wake it
+ */
+static int fmark(struct thread_data *td)
+{
+	return __sync_bool_compare_and_swap(&td->futex, FUTEX_BLOCKED,
+					    FUTEX_RUNNING);
+}
+
+/*
+ * wait for someone to fpost us.  Make sure to set the futex to
+ * FUTEX_BLOCKED beforehand.  Backends can wake up early or for no reason,
+ * we go back to sleep unless the futex says we were posted or we're
+ * shutting down
+ */
+static void fwait(struct thread_data *td)
+{
+	while (1) {
+		/* Is the futex available? */
+		if (__sync_bool_compare_and_swap(&td->futex, FUTEX_RUNNING,
+						 FUTEX_BLOCKED)) {
+			break;      /* Yes */
+		}
+		if (stopping)
+			break;
+		/* Futex is not available; wait */
+		wake_ops[wake_backend].block(td);
+	}
+}
+
+/*
+ * -p mode transports.  The worker sends pipe_test bytes up to its message
+ * thread and waits for pipe_test bytes to come back down.  The message
+ * thread relays them, so every round trip moves the payload through the
+ * kernel (or the shm ring) twice.  Once the message thread closes its end,
+ * the worker's sends and receives fail and it gives up
+ */
+#define SHM_RING_SIZE (64 * 1024)
+#define SHM_RING_SPINS 1000
+
+/*
+ * single producer, single consumer byte ring.  head and tail are free
+ * running and double as futex words when a side has to sleep
+ */
+struct shm_ring {
+	unsigned int head;
+	unsigned int tail;
+	int sleepers;
+	int closed;
+	char data[SHM_RING_SIZE];
+};
+
+struct transport_ops {
+	void (*init)(struct thread_data *td);
+	int (*send)(struct thread_data *td, char *buf, size_t len);
+	int (*recv)(struct thread_data *td, char *buf, size_t len);
+	/* message thread, move len bytes from worker's upstream to downstream */
+	int (*relay)(struct thread_data *msg, struct thread_data *worker, size_t len);
+	void (*close_msg)(struct thread_data *td);
+	void (*cleanup)(struct thread_data *td);
+};
+
+/* write it all, -1 if the other side is gone */
+static int write_full(int fd, char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EPIPE)
+				return -1;
+			perror("transport write");
+			exit(1);
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* read it all, -1 if the other side is gone */
+static int read_full(int fd, char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = read(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ECONNRESET)
+				return -1;
+			perror("transport read");
+			exit(1);
+		}
+		if (ret == 0)
+			return -1;
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static void close_chan(struct thread_data *td, int a, int b)
+{
+	if (td->chan[a] >= 0)
+		close(td->chan[a]);
+	if (td->chan[b] >= 0 && td->chan[b] != td->chan[a])
+		close(td->chan[b]);
+	td->chan[a] = -1;
+	td->chan[b] = -1;
+}
+
+static void fd_chan_close_msg(struct thread_data *td)
+{
+	close_chan(td, CHAN_UP_READ, CHAN_DOWN_WRITE);
+}
+
+static void fd_chan_cleanup(struct thread_data *td)
+{
+	close_chan(td, CHAN_UP_WRITE, CHAN_DOWN_READ);
+	fd_chan_close_msg(td);
+}
+
+static int fd_chan_send(struct thread_data *td, char *buf, size_t len)
+{
+	return write_full(td->chan[CHAN_UP_WRITE], buf, len);
+}
+
+static int fd_chan_recv(struct thread_data *td, char *buf, size_t len)
+{
+	return read_full(td->chan[CHAN_DOWN_READ], buf, len);
+}
+
+static int fd_chan_relay(struct thread_data *msg, struct thread_data *worker,
+			 size_t len)
+{
+	if (read_full(worker->chan[CHAN_UP_READ], msg->pipe_page, len))
+		return -1;
+	worker->wake_time = nsec_now();
+	return write_full(worker->chan[CHAN_DOWN_WRITE], msg->pipe_page, len);
+}
+
+static void pipe_chan_init(struct thread_data *td)
+{
+	int fds[2];
+
+	if (pipe(fds) < 0) {
+		perror("pipe");
+		exit(1);
+	}
+	td->chan[CHAN_UP_READ] = fds[0];
+	td->chan[CHAN_UP_WRITE] = fds[1];
+	if (pipe(fds) < 0) {
+		perror("pipe");
+		exit(1);
+	}
+	td->chan[CHAN_DOWN_READ] = fds[0];
+	td->chan[CHAN_DOWN_WRITE] = fds[1];
+}
+
+static void socketpair_chan_init(struct thread_data *td)
+{
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		perror("socketpair");
+		exit(1);
+	}
+	td->chan[CHAN_UP_WRITE] = sv[0];
+	td->chan[CHAN_DOWN_READ] = sv[0];
+	td->chan[CHAN_UP_READ] = sv[1];
+	td->chan[CHAN_DOWN_WRITE] = sv[1];
+}
+
+/*
+ * the socketpair is one fd in each direction, so the message thread
+ * can't close its end without taking the worker's with it.  shutdown()
+ * makes the worker's reads and writes fail instead
+ */
+static void socketpair_chan_close_msg(struct thread_data *td)
+{
+	if (td->chan[CHAN_UP_READ] >= 0)
+		shutdown(td->chan[CHAN_UP_READ], SHUT_RDWR);
+}
+
+/*
+ * --pipe-transport vmsplice maps the worker's pages into the upstream
+ * pipe, the message thread splices them across to the downstream pipe
+ * without copying, and the worker read()s them back out.  The pages the
+ * worker reads into are the same ones it gifted, which is fine for
+ * a benchmark that never looks at the bytes
+ */
+static void vmsplice_chan_init(struct thread_data *td)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	int size;
+
+	/*
+	 * the whole message has to fit in the pipes, the message thread
+	 * won't splice the reply down until the worker's done sending
+	 * and the worker doesn't read until then either.  Each page the
+	 * buffer touches takes a pipe slot, so leave room for one more
+	 * page than pipe_test in case the splice doesn't start aligned
+	 */
+	pipe_chan_init(td);
+	size = (pipe_test + page - 1) / page * page + page;
+	if (fcntl(td->chan[CHAN_UP_WRITE], F_SETPIPE_SZ, size) < 0 ||
+	    fcntl(td->chan[CHAN_DOWN_WRITE], F_SETPIPE_SZ, size) < 0) {
+		perror("unable to grow pipe for vmsplice, see /proc/sys/fs/pipe-max-size");
+		exit(1);
+	}
+}
+
+static int vmsplice_chan_send(struct thread_data *td, char *buf, size_t len)
+{
+	struct iovec iov;
+	ssize_t ret;
+
+	while (len) {
+		iov.iov_base = buf;
+		iov.iov_len = len;
+		ret = vmsplice(td->chan[CHAN_UP_WRITE], &iov, 1, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EPIPE)
+				return -1;
+			perror("vmsplice");
+			exit(1);
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int vmsplice_chan_relay(struct thread_data *msg, struct thread_data *worker,
+			       size_t len)
+{
+	ssize_t ret;
+	int first = 1;
+
+	(void)msg;
+	while (len) {
+		ret = splice(worker->chan[CHAN_UP_READ], NULL,
+			     worker->chan[CHAN_DOWN_WRITE], NULL, len,
+			     SPLICE_F_MOVE);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EPIPE)
+				return -1;
+			perror("splice");
+			exit(1);
+		}
+		if (ret == 0)
+			return -1;
+		/* the reply starts once the first bytes make it through */
+		if (first) {
+			worker->wake_time = nsec_now();
+			first = 0;
+		}
+		len -= ret;
+	}
+	return 0;
+}
+
+static struct shm_ring *shm_ring_alloc(void)
+{
+	struct shm_ring *ring;
+
+	ring = mmap(NULL, sizeof(*ring), PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (ring == MAP_FAILED) {
+		perror("unable to allocate shm ring");
+		exit(1);
+	}
+	return ring;
+}
+
+/*
+ * wait for *word to move away from old.  We spin a little first, and
+ * the sleepers count tells the other side it has to FUTEX_WAKE us
+ */
+static void shm_ring_wait(struct shm_ring *ring, unsigned int *word,
+			  unsigned int old)
+{
+	int i;
+
+	for (i = 0; i < SHM_RING_SPINS; i++) {
+		if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != old ||
+		    __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE))
+			return;
+		nop;
+	}
+	__atomic_add_fetch(&ring->sleepers, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(word, __ATOMIC_SEQ_CST) == old &&
+	    !__atomic_load_n(&ring->closed, __ATOMIC_SEQ_CST))
+		futex((int *)word, FUTEX_WAIT_PRIVATE, old, NULL, NULL, 0);
+	__atomic_sub_fetch(&ring->sleepers, 1, __ATOMIC_SEQ_CST);
+}
+
+static void shm_ring_kick(struct shm_ring *ring, unsigned int *word)
+{
+	if (__atomic_load_n(&ring->sleepers, __ATOMIC_SEQ_CST))
+		futex((int *)word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static int shm_ring_write(struct shm_ring *ring, char *buf, size_t len)
+{
+	unsigned int head, tail, off;
+	size_t n;
+
+	while (len) {
+		if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE))
+			return -1;
+		tail = ring->tail;
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		n = SHM_RING_SIZE - (tail - head);
+		if (!n) {
+			shm_ring_wait(ring, &ring->head, head);
+			continue;
+		}
+		off = tail % SHM_RING_SIZE;
+		if (n > SHM_RING_SIZE - off)
+			n = SHM_RING_SIZE - off;
+		if (n > len)
+			n = len;
+		memcpy(ring->data + off, buf, n);
+		__atomic_store_n(&ring->tail, tail + n, __ATOMIC_SEQ_CST);
+		shm_ring_kick(ring, &ring->tail);
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int shm_ring_read(struct shm_ring *ring, char *buf, size_t len)
+{
+	unsigned int head, tail, off;
+	size_t n;
+
+	while (len) {
+		head = ring->head;
+		tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		n = tail - head;
+		if (!n) {
+			if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE))
+				return -1;
+			shm_ring_wait(ring, &ring->tail, tail);
+			continue;
+		}
+		off = head % SHM_RING_SIZE;
+		if (n > SHM_RING_SIZE - off)
+			n = SHM_RING_SIZE - off;
+		if (n > len)
+			n = len;
+		memcpy(buf, ring->data + off, n);
+		__atomic_store_n(&ring->head, head + n, __ATOMIC_SEQ_CST);
+		shm_ring_kick(ring, &ring->head);
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void shm_chan_init(struct thread_data *td)
+{
+	int i;
+
+	for (i = 0; i < NR_RINGS; i++)
+		td->ring[i] = shm_ring_alloc();
+}
+
+static int shm_chan_send(struct thread_data *td, char *buf, size_t len)
+{
+	return shm_ring_write(td->ring[RING_UP], buf, len);
+}
+
+static int shm_chan_recv(struct thread_data *td, char *buf, size_t len)
+{
+	return shm_ring_read(td->ring[RING_DOWN], buf, len);
+}
+
+static int shm_chan_relay(struct thread_data *msg, struct thread_data *worker,
+			  size_t len)
+{
+	if (shm_ring_read(worker->ring[RING_UP], msg->pipe_page, len))
+		return -1;
+	worker->wake_time = nsec_now();
+	return shm_ring_write(worker->ring[RING_DOWN], msg->pipe_page, len);
+}
+
+static void shm_chan_close_msg(struct thread_data *td)
+{
+	int i;
+
+	for (i = 0; i < NR_RINGS; i++) {
+		__atomic_store_n(&td->ring[i]->closed, 1, __ATOMIC_SEQ_CST);
+		futex((int *)&td->ring[i]->head, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+		futex((int *)&td->ring[i]->tail, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+	}
+}
+
+static void shm_chan_cleanup(struct thread_data *td)
+{
+	int i;
+
+	for (i = 0; i < NR_RINGS; i++) {
+		munmap(td->ring[i], sizeof(struct shm_ring));
+		td->ring[i] = NULL;
+	}
+}
+
+static struct transport_ops transport_ops[] = {
+	[TRANSPORT_MEMSET] = { NULL, NULL, NULL, NULL, NULL, NULL },
+	[TRANSPORT_PIPE] = { pipe_chan_init, fd_chan_send, fd_chan_recv,
+			     fd_chan_relay, fd_chan_close_msg, fd_chan_cleanup },
+	[TRANSPORT_SOCKETPAIR] = { socketpair_chan_init, fd_chan_send, fd_chan_recv,
+				   fd_chan_relay, socketpair_chan_close_msg,
+				   fd_chan_cleanup },
+	[TRANSPORT_SHM] = { shm_chan_init, shm_chan_send, shm_chan_recv,
+			    shm_chan_relay, shm_chan_close_msg, shm_chan_cleanup },
+	[TRANSPORT_VMSPLICE] = { vmsplice_chan_init, vmsplice_chan_send, fd_chan_recv,
+				 vmsplice_chan_relay, fd_chan_close_msg,
+				 fd_chan_cleanup },
+};
+
+/*
+ * true when -p mode moves its bytes over a real channel.  RPS workers
+ * never talk to the dispatcher, it just hands them requests.  There is
+ * nobody to relay -p bytes for them, so they keep the memset
+ */
+static int use_transport(void)
+{
+	return pipe_test && transport != TRANSPORT_MEMSET && !requests_per_sec;
+}
+
+static void transport_init(struct thread_data *td)
+{
+	int i;
+
+	for (i = 0; i < NR_CHAN_FDS; i++)
+		td->chan[i] = -1;
+	if (use_transport())
+		transport_ops[transport].init(td);
+}
+
+/* the message thread is done relaying, kick td out of any transfer */
+static void transport_close_msg(struct thread_data *td)
+{
+	if (use_transport())
+		transport_ops[transport].close_msg(td);
+}
+
+static void transport_cleanup(struct thread_data *td)
+{
+	if (use_transport())
+		transport_ops[transport].cleanup(td);
+}
+
+/*
+ * cmpxchg based list prepend
+ */
+static void xlist_add(struct thread_data *head, struct thread_data *add)
+{
+	struct thread_data *old;
+	struct thread_data *ret;
+
+	while (1) {
+		old = head->next;
+		add->next = old;
+		ret = __sync_val_compare_and_swap(&head->next, old, add);
+		if (ret == old)
+			break;
+	}
+}
+
+/*
+ * xchg based list splicing.  This returns the entire list and
+ * replaces the head->next with NULL
+ */
+static struct thread_data *xlist_splice(struct thread_data *head)
+{
+	struct thread_data *old;
+	struct thread_data *ret;
+
+	while (1) {
+		old = head->next;
+		ret = __sync_val_compare_and_swap(&head->next, old, NULL);
+		if (ret == old)
+			break;
+	}
+	return ret;
+}
+
+/*
+ * cmpxchg based list prepend
+ */
+static struct request *request_add(struct thread_data *head, struct request *add)
+{
+	struct request *old;
+	struct request *ret;
+
+	while (1) {
+		old = head->request;
+		add->next = old;
+		ret = __sync_val_compare_and_swap(&head->request, old, add);
+		if (ret == old)
+			return old;
+	}
+}
+
+/*
+ * xchg based list splicing.  This returns the entire list and
+ * replaces the head->request with NULL.  The list is reversed before
+ * returning
+ */
+static struct request *request_splice(struct thread_data *head)
+{
+	struct request *old;
+	struct request *ret;
+	struct request *reverse = NULL;
+
+	while (1) {
+		old = head->request;
+		ret = __sync_val_compare_and_swap(&head->request, old, NULL);
+		if (ret == old)
+			break;
+	}
+
+	while(ret) {
+		struct request *tmp = ret;
+		ret = ret->next;
+		tmp->next = reverse;
+		reverse = tmp;
+	}
+	return reverse;
+}
+
+/*
+ * cmpxchg based prepend onto the owning worker's free list.  With --steal
+ * other workers free into it too, and the dispatcher splices the list
+ * concurrently
+ */
+static void free_request(struct request *req)
+{
+	struct thread_data *td = req->owner;
+	struct request *old;
+	struct request *ret;
+
+	while (1) {
+		old = td->free_requests;
+		req->next = old;
+		ret = __sync_val_compare_and_swap(&td->free_requests, old, req);
+		if (ret == old)
+			break;
+	}
+}
+
+/*
+ * xchg based list splicing for the free list, returns everything the worker
+ * has freed so far
+ */
+static struct request *free_request_splice(struct thread_data *td)
+{
+	struct request *old;
+	struct request *ret;
+
+	while (1) {
+		old = td->free_requests;
+		ret = __sync_val_compare_and_swap(&td->free_requests, old, NULL);
+		if (ret == old)
+			break;
+	}
+	return ret;
+}
+
+static void alloc_request_pool(struct thread_data *td)
+{
+	unsigned long slots = 1;
+	int i;
+
+	td->request_pool = calloc(request_pool_size, sizeof(struct request));
+	if (!td->request_pool) {
+		perror("unable to allocate request pool");
+		exit(1);
+	}
+	for (i = 0; i < request_pool_size; i++) {
+		td->request_pool[i].owner = td;
+		if (i < request_pool_size - 1)
+			td->request_pool[i].next = td->request_pool + i + 1;
+	}
+	td->free_cache = td->request_pool;
+	td->free_requests = NULL;
+
+	if (steal) {
+		while (slots < (unsigned long)request_pool_size)
+			slots <<= 1;
+		td->deque.slots = calloc(slots, sizeof(struct request *));
+		if (!td->deque.slots) {
+			perror("unable to allocate request deque");
+			exit(1);
+		}
+		td->deque.mask = slots - 1;
+	}
+}
+
+static void free_request_pool(struct thread_data *td)
+{
+	free(td->request_pool);
+	free(td->deque.slots);
+}
+
+/* only called by the dispatcher */
+static void deque_push(struct request_deque *dq, struct request *req)
+{
+	long b = dq->bottom;
+
+	dq->slots[b & dq->mask] = req;
+	__atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * take the oldest request off the top, safe to call from any thread.  If we
+ * race with someone else for the same slot we go around again
+ */
+static struct request *deque_take(struct request_deque *dq)
+{
+	struct request *req;
+	long t;
+	long b;
+
+	while (1) {
+		t = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+		b = __atomic_load_n(&dq->bottom, __ATOMIC_ACQUIRE);
+		if (t >= b)
+			return NULL;
+		req = __atomic_load_n(&dq->slots[t & dq->mask], __ATOMIC_RELAXED);
+		if (__sync_bool_compare_and_swap(&dq->top, t, t + 1))
+			return req;
+	}
+}
+
+static long deque_len(struct request_deque *dq)
+{
+	return __atomic_load_n(&dq->bottom, __ATOMIC_ACQUIRE) -
+		__atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * called by the dispatcher to grab a request from the worker's pool.  This
+ * returns NULL when every request is still queued or running on the worker
+ */
+static struct request *allocate_request(struct thread_data *td)
+{
+	struct request *ret = td->free_cache;
+
+	if (!ret) {
+		ret = free_request_splice(td);
+		if (!ret)
+			return NULL;
+	}
+	td->free_cache = ret->next;
+
+	ret->start_time = nsec_now();
+	ret->intended_time = ret->start_time;
+	ret->class = -1;
+	ret->next = NULL;
+	return ret;
+}
+
+
+/*
+ * fpost, and with --wake-fanout charge the cpu time it took to the waker.
+ * Wall time would also count the time the wakee spent running on our cpu
+ * before we got it back
+ */
+static void timed_fpost(struct thread_data *waker, struct thread_data *td)
+{
+	unsigned long long start;
+
+	if (!wake_fanout) {
+		fpost(td);
+		return;
+	}
+	start = thread_cpu_ns();
+	fpost(td);
+	waker->wakes++;
+	waker->wake_cost += thread_cpu_ns() - start;
+}
+
+/*
+ * --wake-fanout.  Posting a long list one futex at a time means the last
+ * worker's latency is mostly the waker's syscalls.  Instead we cut the
+ * list into at most wake_fanout chains and only post the head of each.
+ * A head wakes its own chain the same way as soon as it runs, so the
+ * list gets woken as a tree.  Everyone gets the original wake_time, so
+ * the latency still covers the whole trip down the tree
+ */
+static void wake_chains(struct thread_data *waker, struct thread_data *list,
+			unsigned long long now, int cpu)
+{
+	struct thread_data *head;
+	struct thread_data *tail;
+	int nr = 0;
+	int chain_len;
+	int i;
+
+	for (head = list; head; head = head->next)
+		nr++;
+	chain_len = (nr + wake_fanout - 1) / wake_fanout;
+
+	while (list) {
+		head = list;
+		tail = head;
+		for (i = 1; i < chain_len && tail->next; i++)
+			tail = tail->next;
+		list = tail->next;
+		tail->next = NULL;
+
+		head->wake_chain = head->next;
+		head->next = NULL;
+		head->wake_cpu = cpu;
+		if (pipe_test) {
+			memset(head->pipe_page, 1, pipe_test);
+			head->wake_time = nsec_now();
+		} else {
+			head->wake_time = now;
+		}
+		timed_fpost(waker, head);
+	}
+}
+
+/*
+ * Wake everyone currently waiting on the message list, filling in their
+ * thread_data->wake_time with the current time.
+ *
+ * It's not exactly the current time, it's really the time at the start of
+ * the list run.  We want to detect when the scheduler is just preempting the
+ * waker and giving away the rest of its timeslice.  So we read the clock once
+ * at the start of the loop and use that for all the threads we wake.
+ *
+ * Since pipe mode ends up measuring this other ways, we read the clock
+ * every time in pipe mode.  With a real --pipe-transport the relay is the
+ * wakeup, the worker is sleeping in its receive and the clock is read once
+ * we've taken its payload and start sending the reply.
+ *
+ * --wake futex-waitv marks everyone on the list runnable and then wakes
+ * them all with a single FUTEX_WAKE on our batch word
+ */
+static void xlist_wake_all(struct thread_data *td)
+{
+	struct thread_data *list;
+	struct thread_data *next;
+	unsigned long long now;
+	int batch = wake_ops[wake_backend].kick_batch != NULL;
+	int kick = 0;
+	int cpu;
+
+	list = xlist_splice(td);
+	now = nsec_now();
+	cpu = placement ? sched_getcpu() : -1;
+	/* the transports have to relay through us, no help there */
+	if (wake_fanout && list && !use_transport()) {
+		wake_chains(td, list, now, cpu);
+		return;
+	}
+	while (list) {
+		next = list->next;
+		list->next = NULL;
+		list->wake_cpu = cpu;
+		if (use_transport()) {
+			/* workers only hang up on their way out */
+			if (transport_ops[transport].relay(td, list, pipe_test) &&
+			    !stopping) {
+				fprintf(stderr, "worker hung up its %s channel\n",
+					transport_names[transport]);
+				exit(1);
+			}
+			list = next;
+			continue;
+		} else if (pipe_test) {
+			memset(list->pipe_page, 1, pipe_test);
+			list->wake_time = nsec_now();
+		} else {
+			list->wake_time = now;
+		}
+		if (batch)
+			kick |= fmark(list);
+		else
+			timed_fpost(td, list);
+		list = next;
+	}
+	if (kick)
+		wake_ops[wake_backend].kick_batch(td);
+}
+
+/*
  * called by worker threads to send a message and wait for the answer.
- * In reality we're just trading one cacheline with the gtod and futex in
- * it, but that's good enough.  We gtod after waking and use that to
- * record scheduler latency.
+ * In reality we're just trading one cacheline with the timestamp and futex
+ * in it, but that's good enough.  We read the clock after waking and use that
+ * to record scheduler latency.
+ */
+static struct request *msg_and_wait(struct thread_data *td)
+{
+	struct request *req;
+
+	if (pipe_test && !use_transport())
+		memset(td->pipe_page, 2, pipe_test);
+
+	/* set ourselves to blocked */
+	td->futex = FUTEX_BLOCKED;
+	td->wake_time = nsec_now();
+
+	/* add us to the list */
+	if (requests_per_sec) {
+		req = request_splice(td);
+		if (req) {
+			td->futex = FUTEX_RUNNING;
+			return req;
+		}
+	} else {
+		xlist_add(td->msg_thread, td);
+	}
+
+	fpost(td->msg_thread);
+
+	/* the reply coming back down the channel is our wakeup */
+	if (use_transport()) {
+		if (!transport_ops[transport].send(td, td->pipe_page, pipe_test))
+			transport_ops[transport].recv(td, td->pipe_page, pipe_test);
+		td->futex = FUTEX_RUNNING;
+		return NULL;
+	}
+
+	/*
+	 * don't wait if the main threads are shutting down,
+	 * they will never kick us fpost has a full barrier, so as long
+	 * as the message thread walks his list after setting stopping,
+	 * we shouldn't miss the wakeup
+	 */
+	if (!stopping) {
+		struct thread_data *chain;
+
+		/* if he hasn't already woken us up, wait */
+		fwait(td);
+		/* the shutdown kick doesn't set wake_time */
+		if (!stopping)
+			record_extra_lat(td, LAT_WAKEUP,
+					 nsdelta(td->wake_time, nsec_now()));
+
+		/* we're a --wake-fanout head, pass it on */
+		chain = td->wake_chain;
+		if (chain) {
+			td->wake_chain = NULL;
+			wake_chains(td, chain, td->wake_time,
+				    placement ? sched_getcpu() : -1);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * hand a request to a worker and kick it.  With --steal, if the worker
+ * already had something queued, we kick its neighbor too so there's
+ * someone awake to come steal it
+ */
+static void queue_request(struct thread_data *worker, struct request *req,
+			  unsigned long long now)
+{
+	struct thread_data *workers = worker->msg_thread + 1;
+	struct thread_data *neighbor;
+
+	req->wake_cpu = placement ? sched_getcpu() : -1;
+	if (steal) {
+		deque_push(&worker->deque, req);
+		if (worker_threads > 1 && deque_len(&worker->deque) > 1) {
+			neighbor = workers + (worker - workers + 1) % worker_threads;
+			neighbor->wake_time = now;
+			fpost(neighbor);
+		}
+	} else {
+		request_add(worker, req);
+	}
+	worker->wake_time = now;
+	fpost(worker);
+}
+
+/*
+ * --steal mode, grab our own oldest request, or failing that, the oldest
+ * request of the first sibling worker that has one
+ */
+static struct request *next_request(struct thread_data *td)
+{
+	struct thread_data *workers = td->msg_thread + 1;
+	struct thread_data *victim;
+	struct request *req;
+	int me = td - workers;
+	int i;
+
+	req = deque_take(&td->deque);
+	if (req)
+		return req;
+
+	for (i = 1; i < worker_threads; i++) {
+		victim = workers + (me + i) % worker_threads;
+		req = deque_take(&victim->deque);
+		if (req) {
+			td->steals++;
+			return req;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * --steal mode, sleep until the dispatcher or a neighbor kicks us.  The
+ * barrier pairs with the one in fpost(), so either we see the request
+ * the dispatcher just pushed or it sees us blocked and wakes us
+ */
+static void wait_for_request(struct thread_data *td)
+{
+	td->futex = FUTEX_BLOCKED;
+	__sync_synchronize();
+	if (stopping || deque_len(&td->deque) > 0) {
+		td->futex = FUTEX_RUNNING;
+		return;
+	}
+	fwait(td);
+	/* the shutdown kick doesn't set wake_time */
+	if (!stopping)
+		record_extra_lat(td, LAT_WAKEUP, nsdelta(td->wake_time, nsec_now()));
+}
+
+/*
+ * --placement reads the CPU topology out of sysfs.  We only track the CPUs
+ * we're allowed to run on, and identify cores and LLCs by the lowest CPU
+ * number that shares them
+ */
+struct cpu_topo {
+	int cpu;
+	int core;
+	int llc;
+	int node;
+	/* our index among our SMT siblings */
+	int smt;
+};
+
+/* every CPU in our affinity mask, in compact order */
+static struct cpu_topo *topo;
+static int nr_topo;
+/* indexed by CPU number, NULL if we're not allowed to run there */
+static struct cpu_topo **topo_map;
+static int topo_map_size;
+/* the same CPUs in the order --placement=scatter hands them out */
+static struct cpu_topo **topo_scatter;
+
+/* read the first number out of a sysfs file, "4-7,12" gives 4 */
+static int read_sysfs_int(char *path)
+{
+	char buf[64];
+	int fd;
+	int ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	ret = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (ret <= 0)
+		return -1;
+	buf[ret] = '\0';
+	return atoi(buf);
+}
+
+/* the lowest CPU sharing the highest level cache with this one */
+static int read_cpu_llc(int cpu)
+{
+	char path[256];
+	int best_level = -1;
+	int llc = -1;
+	int level;
+	int i;
+
+	for (i = 0; ; i++) {
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, i);
+		level = read_sysfs_int(path);
+		if (level < 0)
+			break;
+		if (level > best_level) {
+			snprintf(path, sizeof(path),
+				 "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list",
+				 cpu, i);
+			best_level = level;
+			llc = read_sysfs_int(path);
+		}
+	}
+	return llc;
+}
+
+static int read_cpu_node(int cpu)
+{
+	char path[256];
+	struct dirent *de;
+	DIR *dir;
+	int node = 0;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	dir = opendir(path);
+	if (!dir)
+		return 0;
+	while ((de = readdir(dir)) != NULL) {
+		if (!strncmp(de->d_name, "node", 4) &&
+		    de->d_name[4] >= '0' && de->d_name[4] <= '9') {
+			node = atoi(de->d_name + 4);
+			break;
+		}
+	}
+	closedir(dir);
+	return node;
+}
+
+static int topo_compact_cmp(const void *a, const void *b)
+{
+	const struct cpu_topo *ta = a;
+	const struct cpu_topo *tb = b;
+
+	if (ta->node != tb->node)
+		return ta->node - tb->node;
+	if (ta->llc != tb->llc)
+		return ta->llc - tb->llc;
+	if (ta->core != tb->core)
+		return ta->core - tb->core;
+	return ta->cpu - tb->cpu;
+}
+
+struct scatter_key {
+	struct cpu_topo *t;
+	/* smt level, rank within the llc at that level, llc rank, node */
+	int key[4];
+};
+
+static int scatter_cmp(const void *a, const void *b)
+{
+	const struct scatter_key *ka = a;
+	const struct scatter_key *kb = b;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		if (ka->key[i] != kb->key[i])
+			return ka->key[i] - kb->key[i];
+	}
+	return ka->t->cpu - kb->t->cpu;
+}
+
+/*
+ * scatter hands out one SMT thread from each core before doubling up, and
+ * cycles through the LLCs, alternating nodes, as it goes
+ */
+static void build_scatter_order(void)
+{
+	struct scatter_key *keys;
+	unsigned int nr = nr_topo;
+	int i;
+	int j;
+
+	topo_scatter = calloc(nr, sizeof(*topo_scatter));
+	keys = calloc(nr, sizeof(*keys));
+	if (!topo_scatter || !keys) {
+		perror("unable to allocate topology");
+		exit(1);
+	}
+
+	/* topo is in compact order, so everything we count is before us */
+	for (i = 0; i < nr_topo; i++) {
+		keys[i].t = topo + i;
+		keys[i].key[0] = topo[i].smt;
+		keys[i].key[3] = topo[i].node;
+		for (j = 0; j < i; j++) {
+			if (topo[j].llc == topo[i].llc && topo[j].smt == topo[i].smt)
+				keys[i].key[1]++;
+			/* first cpu of a new llc on our node */
+			if (topo[j].node == topo[i].node && topo[j].llc != topo[i].llc &&
+			    (j == 0 || topo[j - 1].llc != topo[j].llc))
+				keys[i].key[2]++;
+		}
+	}
+	qsort(keys, nr_topo, sizeof(*keys), scatter_cmp);
+	for (i = 0; i < nr_topo; i++)
+		topo_scatter[i] = keys[i].t;
+	free(keys);
+}
+
+static void read_topology(void)
+{
+	char path[256];
+	cpu_set_t allowed;
+	int cpu;
+	int i;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+		perror("sched_getaffinity");
+		exit(1);
+	}
+
+	topo = calloc(CPU_COUNT(&allowed), sizeof(*topo));
+	topo_map_size = CPU_SETSIZE;
+	topo_map = calloc(topo_map_size, sizeof(*topo_map));
+	if (!topo || !topo_map) {
+		perror("unable to allocate topology");
+		exit(1);
+	}
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		struct cpu_topo *t;
+
+		if (!CPU_ISSET(cpu, &allowed))
+			continue;
+		t = topo + nr_topo++;
+		t->cpu = cpu;
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+		t->core = read_sysfs_int(path);
+		if (t->core < 0)
+			t->core = cpu;
+		t->llc = read_cpu_llc(cpu);
+		t->node = read_cpu_node(cpu);
+		/*
+		 * no cache info, treat the node as one llc.  Real llc ids are
+		 * cpu numbers, so keep these negative where they can't collide
+		 */
+		if (t->llc < 0)
+			t->llc = -(t->node + 2);
+	}
+
+	if (nr_topo < 1) {
+		fprintf(stderr, "no cpus found for placement\n");
+		exit(1);
+	}
+	qsort(topo, nr_topo, sizeof(*topo), topo_compact_cmp);
+	for (i = 0; i < nr_topo; i++) {
+		topo[i].smt = 0;
+		if (i && topo[i - 1].core == topo[i].core)
+			topo[i].smt = topo[i - 1].smt + 1;
+		topo_map[topo[i].cpu] = topo + i;
+	}
+	build_scatter_order();
+}
+
+/* which of the LAT_SAME_CORE..LAT_CROSS_NODE buckets a wakeup goes in */
+static int wake_locality(int waker, int wakee)
+{
+	struct cpu_topo *a;
+	struct cpu_topo *b;
+
+	if (!placement || waker < 0 || wakee < 0 ||
+	    waker >= topo_map_size || wakee >= topo_map_size)
+		return -1;
+	a = topo_map[waker];
+	b = topo_map[wakee];
+	if (!a || !b)
+		return -1;
+	if (a->core == b->core)
+		return LAT_SAME_CORE;
+	if (a->llc == b->llc)
+		return LAT_SAME_LLC;
+	if (a->node == b->node)
+		return LAT_CROSS_LLC;
+	return LAT_CROSS_NODE;
+}
+
+/*
+ * fill in the CPUs a thread should run on.  worker is -1 for the message
+ * thread itself.  Returns 0 if the thread can go anywhere
+ */
+static int placement_cpus(int msg_index, int worker, cpu_set_t *set)
+{
+	int seq = msg_index * (worker_threads + 1) + worker + 1;
+	int group = -1;
+	int nr_groups = 0;
+	int i;
+
+	CPU_ZERO(set);
+	switch (placement) {
+	case PLACEMENT_COMPACT:
+		CPU_SET(topo[seq % nr_topo].cpu, set);
+		return 1;
+	case PLACEMENT_SCATTER:
+		CPU_SET(topo_scatter[seq % nr_topo]->cpu, set);
+		return 1;
+	case PLACEMENT_LLC:
+	case PLACEMENT_NUMA:
+		/* topo is sorted by node and llc, so groups are contiguous */
+		for (i = 0; i < nr_topo; i++) {
+			int id = placement == PLACEMENT_LLC ? topo[i].llc : topo[i].node;
+			int prev = -1;
+
+			if (i)
+				prev = placement == PLACEMENT_LLC ? topo[i - 1].llc : topo[i - 1].node;
+			if (!i || id != prev)
+				nr_groups++;
+		}
+		group = msg_index % nr_groups;
+		nr_groups = 0;
+		for (i = 0; i < nr_topo; i++) {
+			int id = placement == PLACEMENT_LLC ? topo[i].llc : topo[i].node;
+			int prev = -1;
+
+			if (i)
+				prev = placement == PLACEMENT_LLC ? topo[i - 1].llc : topo[i - 1].node;
+			if (i && id != prev)
+				nr_groups++;
+			if (nr_groups == group)
+				CPU_SET(topo[i].cpu, set);
+		}
+		return 1;
+	case PLACEMENT_SMT_PAIR: {
+		/* the message thread gets the first thread of a core */
+		int first = -1;
+		int siblings = 0;
+
+		for (i = 0; i < nr_topo; i++) {
+			if (topo[i].smt == 0)
+				nr_groups++;
+		}
+		group = msg_index % nr_groups;
+		nr_groups = 0;
+		for (i = 0; i < nr_topo; i++) {
+			if (topo[i].smt == 0 && nr_groups++ == group)
+				first = i;
+		}
+		while (first + siblings < nr_topo &&
+		       topo[first + siblings].core == topo[first].core)
+			siblings++;
+
+		/* and the workers share its siblings */
+		if (worker < 0 || siblings == 1)
+			CPU_SET(topo[first].cpu, set);
+		else
+			CPU_SET(topo[first + 1 + worker % (siblings - 1)].cpu, set);
+		return 1;
+	}
+	default:
+		return 0;
+	}
+}
+
+/* pthread_create with whatever affinity --placement picked for us */
+static int create_placed_thread(pthread_t *tid, int msg_index, int worker,
+				void *(*fn)(void *), void *arg)
+{
+	pthread_attr_t attr;
+	cpu_set_t set;
+	int ret;
+
+	if (!placement_cpus(msg_index, worker, &set))
+		return pthread_create(tid, NULL, fn, arg);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+	ret = pthread_create(tid, &attr, fn, arg);
+	pthread_attr_destroy(&attr);
+	return ret;
+}
+
+/*
+ * read /proc/stat, return the percentage of non-idle time since
+ * the last read.
+ */
+float read_busy(int fd, char *buf, int len,
+		unsigned long long *total_time_ret,
+		unsigned long long *idle_time_ret)
+{
+	unsigned long long total_time = 0;
+	unsigned long long idle_time = 0;
+	unsigned long long delta;
+	unsigned long long delta_idle;
+	unsigned long long val;
+	int col = 1;
+	int ret;
+	char *c;
+	char *save = NULL;
+
+
+	ret = lseek(fd, 0, SEEK_SET);
+	if (ret < 0) {
+		perror("lseek");
+		exit(1);
+	}
+	ret = read(fd, buf, len-1);
+	if (ret < 0) {
+		perror("failed to read /proc/stat");
+		exit(1);
+	}
+	buf[ret] = '\0';
+
+	/* find the newline */
+	c = strchr(buf, '\n');
+	if (c == NULL) {
+		perror("unable to parse /proc/stat");
+		exit(1);
+	}
+	*c = '\0';
+
+	/* cpu  590315893 45841886 375984879 82585100131 166708940 0 5453892 0 0 0 */
+	c = strtok_r(buf, " ", &save);
+	if (strcmp(c, "cpu") != 0) {
+		perror("unable to parse summary in /proc/stat");
+		exit(1);
+	}
+
+	while (c != NULL) {
+		c = strtok_r(NULL, " ", &save);
+		if (!c)
+			break;
+		val = atoll(c);
+		if (col++ == 4)
+			idle_time = val;
+		total_time += val;
+	}
+
+	if (*total_time_ret == 0) {
+		*total_time_ret = total_time;
+		*idle_time_ret = idle_time;
+		return 0.0;
+	}
+
+	/* delta is the total time spent doing everything */
+	delta = total_time - *total_time_ret;
+	delta_idle = idle_time - *idle_time_ret;
+
+	*total_time_ret = total_time;
+	*idle_time_ret = idle_time;
+
+	return 100.00 - ((float)delta_idle/(float)delta) * 100.00;
+}
+
+/*
+ * every thread gets its own splitmix64 stream, seeded once from --seed and
+ * its slot in the thread_data array.  It's a handful of instructions and
+ * there's no shared state, unlike rand()
+ */
+#define RNG_GAMMA 0x9e3779b97f4a7c15ULL
+
+static inline uint64_t rng_mix(uint64_t z)
+{
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static void rng_init(uint64_t *rng, unsigned long index)
+{
+	*rng = rng_mix(rng_seed + (index + 1) * RNG_GAMMA);
+}
+
+static inline uint64_t rng_next(uint64_t *rng)
+{
+	*rng += RNG_GAMMA;
+	return rng_mix(*rng);
+}
+
+/* 0 .. n - 1 */
+static inline unsigned long rng_below(uint64_t *rng, unsigned long n)
+{
+	return rng_next(rng) % n;
+}
+
+/* uniform double in (0, 1] */
+static inline double rand_unit(uint64_t *rng)
+{
+	return ((rng_next(rng) >> 11) + 1) * (1.0 / (1ULL << 53));
+}
+
+/* standard normal, Box-Muller */
+static double rand_normal(uint64_t *rng)
+{
+	double u1 = rand_unit(rng);
+	double u2 = rand_unit(rng);
+
+	return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+/* walk the cdf and interpolate between the points on either side */
+static double cdf_sample(struct dist *d, double u)
+{
+	double target = u * d->cdf_frac[d->cdf_len - 1];
+	double span;
+	int lo = 0, hi = d->cdf_len - 1;
+	int mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (d->cdf_frac[mid] < target)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return d->cdf_usec[0];
+	span = d->cdf_frac[lo] - d->cdf_frac[lo - 1];
+	if (span <= 0)
+		return d->cdf_usec[lo];
+	return d->cdf_usec[lo - 1] + (d->cdf_usec[lo] - d->cdf_usec[lo - 1]) *
+		(target - d->cdf_frac[lo - 1]) / span;
+}
+
+/* one draw from d, in usecs, for a distribution with the given mean */
+static unsigned long long dist_sample(struct dist *d, unsigned long long mean,
+				      uint64_t *rng)
+{
+	double m = mean;
+	double v;
+
+	switch (d->type) {
+	case DIST_UNIFORM:
+		v = 2 * m * rand_unit(rng);
+		break;
+	case DIST_EXP:
+		v = -log(rand_unit(rng)) * m;
+		break;
+	case DIST_LOGNORMAL:
+		/* mu is picked so the mean comes out at m */
+		v = m ? exp(log(m) - d->a * d->a / 2 + d->a * rand_normal(rng)) : 0;
+		break;
+	case DIST_BIMODAL: {
+		/* fast and slow draws that still average out to m */
+		double fast = m / (1 - d->a + d->a * d->b);
+
+		v = rand_unit(rng) <= d->a ? fast * d->b : fast;
+		break;
+	}
+	case DIST_PARETO:
+		v = m * (d->a - 1) / d->a / pow(rand_unit(rng), 1 / d->a);
+		if (v > m * PARETO_MAX_MEAN)
+			v = m * PARETO_MAX_MEAN;
+		break;
+	case DIST_CDF:
+		v = cdf_sample(d, rand_unit(rng));
+		break;
+	default:
+		return mean;
+	}
+	return v + 0.5;
+}
+
+/*
+ * usecs of -c for this request.  -j without a --service-dist keeps its old
+ * meaning, anything from 1 to -c
+ */
+static unsigned long long service_usecs(struct thread_data *td)
+{
+	if (service_dist.type != DIST_FIXED)
+		return dist_sample(&service_dist, td->cputime, &td->rng);
+	if (jitter && td->cputime)
+		return rng_below(&td->rng, td->cputime) + 1;
+	return td->cputime;
+}
+
+/*
+ * --stall-detect counters for each cpu, bumped by whoever stalled there.
+ * Stalls are rare so atomics are fine, the alignment keeps cpus from
+ * sharing a line
+ */
+enum {
+	STALL_UNDER_100US = 0,
+	STALL_UNDER_1MS,
+	STALL_UNDER_10MS,
+	STALL_OVER_10MS,
+	NR_STALL_BUCKETS,
+};
+
+static char *stall_bucket_names[] = { "<100us", "<1ms", "<10ms", ">=10ms" };
+
+struct stall_counters {
+	unsigned long long count;
+	unsigned long long ns;
+	unsigned long long buckets[NR_STALL_BUCKETS];
+} __attribute__((aligned(CACHELINE_SIZE)));
+
+static struct stall_counters stall_live[CPU_SETSIZE];
+
+/*
+ * a gap between two clock reads in usec_spin().  Whatever took the cpu away
+ * from us, we charge the cpu we came back on, which is the one a hypervisor
+ * would have charged steal time to
+ */
+static void record_stall(struct thread_data *td, unsigned long long ns)
+{
+	struct stall_counters *c;
+	int cpu = sched_getcpu();
+	int b;
+
+	record_extra_lat(td, LAT_STALL, ns);
+	if (cpu < 0 || cpu >= CPU_SETSIZE)
+		return;
+	if (ns < 100 * NSEC_PER_USEC)
+		b = STALL_UNDER_100US;
+	else if (ns < NSEC_PER_MSEC)
+		b = STALL_UNDER_1MS;
+	else if (ns < 10 * NSEC_PER_MSEC)
+		b = STALL_UNDER_10MS;
+	else
+		b = STALL_OVER_10MS;
+	c = stall_live + cpu;
+	__atomic_add_fetch(&c->count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&c->ns, ns, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&c->buckets[b], 1, __ATOMIC_RELAXED);
+}
+
+static void usec_spin(struct thread_data *td, unsigned long spin_time)
+{
+	unsigned long long start;
+	unsigned long long spin_ns;
+	unsigned long long last;
+	unsigned long long now;
+
+	if (spin_time == 0)
+		return;
+
+	spin_ns = spin_time * NSEC_PER_USEC;
+	start = nsec_now();
+	last = start;
+	while (1) {
+		now = nsec_now();
+		if (stall_thresh_ns && now - last > stall_thresh_ns)
+			record_stall(td, now - last);
+		last = now;
+		if (nsdelta(start, now) > spin_ns)
+			return;
+		nop;
+	}
+}
+
+/*
+ * once the message thread starts all his children, this is where he
+ * loops until our runtime is up.  Basically this sits around waiting
+ * for posting by the worker threads, replying to their messages after
+ * a delay of 'sleeptime' + some jitter.
+ */
+static void run_msg_thread(struct thread_data *td)
+{
+	unsigned long max_jitter = sleeptime / 4;
+	unsigned long spin;
+
+	while (1) {
+		td->futex = FUTEX_BLOCKED;
+		xlist_wake_all(td);
+
+		if (stopping) {
+			xlist_wake_all(td);
+			break;
+		}
+		if (sleeptime)
+			fwait(td);
+
+		/*
+		 * messages shouldn't be instant, sleep a little to make them
+		 * wait
+		 */
+		spin = message_cputime;
+		if (jitter && spin)
+			spin = rng_below(&td->rng, spin) + 1;
+		usec_spin(td, spin);
+		if (!pipe_test && sleeptime) {
+			if (sleep_dist.type != DIST_FIXED)
+				usleep(dist_sample(&sleep_dist, sleeptime, &td->rng));
+			else if (max_jitter)
+				usleep(sleeptime + rng_below(&td->rng, max_jitter));
+			else
+				usleep(sleeptime);
+		}
+	}
+}
+
+/*
+ * -A drives requests_per_sec with a PI controller on CPU busy percent.
+ * The plant is close to linear (busy ~ rps / k), so we keep a smoothed
+ * estimate of k and run the controller in busy percent, scaled back into
+ * RPS by k.  With AUTO_RPS_KI at 1 and a perfect k estimate it would hit
+ * the target in one step, the gains back that off to ride out noise.
+ *
+ * Inside a cgroup v2 container we measure our own cgroup's cpu.stat
+ * against the CPUs it can actually use, otherwise we fall back to the
+ * host wide numbers in /proc/stat
+ */
+#define AUTO_RPS_KP 0.3
+#define AUTO_RPS_KI 0.6
+/* smoothing for the rps per busy percent estimate */
+#define AUTO_RPS_K_ALPHA 0.5
+/* within this many busy percentage points of the target is converged */
+#define AUTO_RPS_BAND 2.0
+/* ... for this many samples in a row */
+#define AUTO_RPS_SETTLED 3
+#define AUTO_RPS_MAX (1ULL << 31)
+
+enum {
+	CPU_SRC_PROC_STAT = 0,
+	CPU_SRC_CGROUP,
+};
+
+struct auto_rps_state {
+	int src;
+	int fd;
+	/* cgroup usage and the wall clock we read it at, in usecs */
+	unsigned long long last_usage;
+	unsigned long long last_wall;
+	/* CPUs our cgroup can use */
+	double capacity;
+	/* /proc/stat totals for read_busy() */
+	unsigned long long total_time;
+	unsigned long long total_idle;
+	unsigned long long start;
+	double last_err;
+	/* requests_per_sec per busy percent */
+	double k;
+	/* a real rps value to carry our fractional steps */
+	double rps;
+	int in_band;
+	/* seconds until we first settled in the band, -1 if we never did */
+	long converge_secs;
+	double err_sum;
+	double abs_err_sum;
+	unsigned long nr_err;
+	int samples;
+};
+
+static struct auto_rps_state auto_rps_state = { .fd = -1, .converge_secs = -1 };
+
+/*
+ * find our cgroup v2 directory from /proc/self/cgroup and the cgroup2
+ * mount.  Inside a cgroup namespace that's "/", but it's still the
+ * container's own cgroup and not the host's
+ */
+static int find_cgroup2_dir(char *dir, size_t len)
+{
+	char line[4096];
+	char mnt[1024] = "";
+	char cg[2048] = "";
+	char fstype[64];
+	char *sep;
+	FILE *fp;
+
+	fp = fopen("/proc/self/cgroup", "r");
+	if (!fp)
+		return -1;
+	while (fgets(line, sizeof(line), fp)) {
+		if (!strncmp(line, "0::", 3)) {
+			sscanf(line + 3, "%2047s", cg);
+			break;
+		}
+	}
+	fclose(fp);
+	if (!cg[0])
+		return -1;
+
+	fp = fopen("/proc/self/mountinfo", "r");
+	if (!fp)
+		return -1;
+	while (fgets(line, sizeof(line), fp)) {
+		/* the fs type comes after the " - " separator */
+		sep = strstr(line, " - ");
+		if (!sep || sscanf(sep + 3, "%63s", fstype) != 1 ||
+		    strcmp(fstype, "cgroup2"))
+			continue;
+		if (sscanf(line, "%*s %*s %*s %*s %1023s", mnt) == 1)
+			break;
+		mnt[0] = '\0';
+	}
+	fclose(fp);
+	if (!mnt[0])
+		return -1;
+	snprintf(dir, len, "%s%s", mnt, strcmp(cg, "/") ? cg : "");
+	return 0;
+}
+
+/*
+ * the real root cgroup is the whole host, and it's the only one without
+ * cgroup.type or cpu.max.  A namespace root has them
+ */
+static int cgroup_is_host_root(char *dir)
+{
+	char path[4096 + 16];
+
+	snprintf(path, sizeof(path), "%s/cgroup.type", dir);
+	if (!access(path, F_OK))
+		return 0;
+	snprintf(path, sizeof(path), "%s/cpu.max", dir);
+	return access(path, F_OK) != 0;
+}
+
+/* usage_usec out of cpu.stat */
+static int read_cgroup_usage(int fd, unsigned long long *usage)
+{
+	char buf[1024];
+	char *c;
+	int ret;
+
+	ret = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (ret <= 0)
+		return -1;
+	buf[ret] = '\0';
+	c = strstr(buf, "usage_usec ");
+	if (!c)
+		return -1;
+	*usage = strtoull(c + strlen("usage_usec "), NULL, 10);
+	return 0;
+}
+
+/* the smaller of cpu.max and our affinity mask */
+static double cgroup_capacity(char *dir)
+{
+	char path[4096 + 16];
+	char quota[64];
+	unsigned long long period;
+	cpu_set_t set;
+	double cpus = 1;
+	FILE *fp;
+
+	if (!sched_getaffinity(0, sizeof(set), &set))
+		cpus = CPU_COUNT(&set);
+	snprintf(path, sizeof(path), "%s/cpu.max", dir);
+	fp = fopen(path, "r");
+	if (!fp)
+		return cpus;
+	if (fscanf(fp, "%63s %llu", quota, &period) == 2 &&
+	    strcmp(quota, "max") && period) {
+		double limit = (double)strtoull(quota, NULL, 10) / period;
+
+		if (limit > 0 && limit < cpus)
+			cpus = limit;
+	}
+	fclose(fp);
+	return cpus;
+}
+
+static void auto_rps_open(struct auto_rps_state *s)
+{
+	char dir[4096];
+	char path[4096 + 16];
+	unsigned long long usage;
+
+	s->start = nsec_now();
+	s->rps = requests_per_sec;
+	if (!find_cgroup2_dir(dir, sizeof(dir)) && !cgroup_is_host_root(dir)) {
+		snprintf(path, sizeof(path), "%s/cpu.stat", dir);
+		s->fd = open(path, O_RDONLY);
+		if (s->fd >= 0 && !read_cgroup_usage(s->fd, &usage)) {
+			s->src = CPU_SRC_CGROUP;
+			s->capacity = cgroup_capacity(dir);
+			s->last_usage = usage;
+			s->last_wall = s->start / NSEC_PER_USEC;
+			fprintf(stderr, "auto-rps: using %s (%.2f cpus)\n", path,
+				s->capacity);
+			return;
+		}
+		if (s->fd >= 0)
+			close(s->fd);
+	}
+
+	s->src = CPU_SRC_PROC_STAT;
+	s->fd = open("/proc/stat", O_RDONLY);
+	if (s->fd < 0) {
+		perror("unable to open /proc/stat");
+		exit(1);
+	}
+	fprintf(stderr, "auto-rps: using /proc/stat\n");
+}
+
+/* busy percent since the last call */
+static float auto_rps_busy(struct auto_rps_state *s)
+{
+	char proc_stat_buf[512];
+	unsigned long long usage, wall;
+	float busy;
+
+	if (s->src == CPU_SRC_PROC_STAT)
+		return read_busy(s->fd, proc_stat_buf, 512, &s->total_time,
+				 &s->total_idle);
+
+	if (read_cgroup_usage(s->fd, &usage)) {
+		perror("unable to read cgroup cpu.stat");
+		exit(1);
+	}
+	wall = nsec_now() / NSEC_PER_USEC;
+	if (wall == s->last_wall)
+		return 0;
+	busy = (double)(usage - s->last_usage) * 100 /
+		((double)(wall - s->last_wall) * s->capacity);
+	s->last_usage = usage;
+	s->last_wall = wall;
+	return busy;
+}
+
+/* called about once a second from sleep_for_runtime() */
+static void auto_scale_rps(struct auto_rps_state *s)
+{
+	float busy;
+	double err;
+	double next;
+
+	if (s->fd < 0) {
+		auto_rps_open(s);
+		/* /proc/stat needs one read for a baseline */
+		if (s->src == CPU_SRC_PROC_STAT)
+			auto_rps_busy(s);
+		return;
+	}
+	busy = auto_rps_busy(s);
+	err = auto_rps - busy;
+	s->samples++;
+
+	/* learn the rps per busy percent, busy that low is mostly noise */
+	if (busy > 1 && s->rps > 0) {
+		double k = s->rps / busy;
+
+		s->k = s->k ? s->k + AUTO_RPS_K_ALPHA * (k - s->k) : k;
+	}
+
+	if (!s->k) {
+		/* nothing to scale by yet, just get some load going */
+		next = s->rps * 2 + 1;
+	} else {
+		next = s->rps + s->k * (AUTO_RPS_KP * (err - s->last_err) +
+					AUTO_RPS_KI * err);
+	}
+	s->last_err = err;
+
+	/* zero would drop the workers out of RPS mode */
+	if (next < 1)
+		next = 1;
+	if (next >= AUTO_RPS_MAX)
+		next = AUTO_RPS_MAX - 1;
+	s->rps = next;
+	requests_per_sec = llround(next);
+
+	/* convergence and steady state error for the report */
+	if (fabs(err) <= AUTO_RPS_BAND) {
+		s->in_band++;
+		if (s->in_band >= AUTO_RPS_SETTLED && s->converge_secs < 0)
+			s->converge_secs = nsdelta(s->start, nsec_now()) / NSEC_PER_SEC;
+	} else {
+		s->in_band = 0;
+	}
+	if (s->converge_secs >= 0) {
+		s->err_sum += err;
+		s->abs_err_sum += fabs(err);
+		s->nr_err++;
+	}
+}
+
+/*
+ * --group cgroups.  Threads of one process can only be split across
+ * cgroups in a threaded subtree, so we make a schbench.<pid> cgroup under
+ * the root, move the whole process in there, and give each group a
+ * threaded child.  cpu and cpuset both work in threaded mode.  Message
+ * threads move themselves in at startup and their workers inherit it
+ */
+static char group_base[4096 + 64];
+static char group_orig[4096];
+
+static int write_cgroup_file(char *dir, char *file, char *val)
+{
+	char path[8192];
+	int fd;
+	int ret;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -1;
+	ret = write(fd, val, strlen(val));
+	close(fd);
+	return ret < 0 ? -1 : 0;
+}
+
+/*
+ * everyone in the groups has exited (or we're bailing out), put ourselves
+ * back and clean up
+ */
+static void teardown_group_cgroups(void)
+{
+	char val[32];
+	int i;
+
+	if (!group_base[0])
+		return;
+	snprintf(val, sizeof(val), "%d", getpid());
+	write_cgroup_file(group_orig, "cgroup.procs", val);
+	for (i = 0; i < nr_groups; i++) {
+		if (groups[i].dir[0] && rmdir(groups[i].dir))
+			fprintf(stderr, "unable to remove %s: %s\n", groups[i].dir,
+				strerror(errno));
+	}
+	if (rmdir(group_base))
+		fprintf(stderr, "unable to remove %s: %s\n", group_base, strerror(errno));
+}
+
+/* anything that goes wrong after we made group_base has to clean it up */
+static void cgroup_die(void)
+{
+	teardown_group_cgroups();
+	exit(1);
+}
+
+static void write_cgroup_or_die(char *dir, char *file, char *val)
+{
+	if (write_cgroup_file(dir, file, val)) {
+		fprintf(stderr, "unable to write '%s' to %s/%s: %s\n", val, dir,
+			file, strerror(errno));
+		cgroup_die();
+	}
+}
+
+static int group_needs_cgroup(struct worker_group *g)
+{
+	return g->weight || g->max[0] || g->cpus[0];
+}
+
+/* is controller listed in dir's cgroup.controllers */
+static int cgroup_has_controller(char *dir, char *controller)
+{
+	char path[8192];
+	char name[64];
+	FILE *fp;
+	int found = 0;
+
+	snprintf(path, sizeof(path), "%s/cgroup.controllers", dir);
+	fp = fopen(path, "r");
+	if (!fp)
+		return 0;
+	while (!found && fscanf(fp, "%63s", name) == 1)
+		found = !strcmp(name, controller);
+	fclose(fp);
+	return found;
+}
+
+static void setup_group_cgroups(void)
+{
+	char controllers[32] = "";
+	char val[64];
+	char *root;
+	int need_cpu = 0;
+	int need_cpuset = 0;
+	int i;
+
+	for (i = 0; i < nr_groups; i++) {
+		need_cpu |= groups[i].weight || groups[i].max[0];
+		need_cpuset |= !!groups[i].cpus[0];
+	}
+	if (!need_cpu && !need_cpuset)
+		return;
+
+	if (find_cgroup2_dir(group_orig, sizeof(group_orig))) {
+		fprintf(stderr, "--group cgroup settings need cgroup v2\n");
+		exit(1);
+	}
+	root = cgroup_root ? cgroup_root : group_orig;
+
+	/* check before we make anything we'd have to clean up */
+	if (need_cpu) {
+		if (!cgroup_has_controller(root, "cpu")) {
+			fprintf(stderr, "the cpu controller isn't available in %s\n", root);
+			exit(1);
+		}
+		strcat(controllers, "+cpu ");
+	}
+	if (need_cpuset) {
+		if (!cgroup_has_controller(root, "cpuset")) {
+			fprintf(stderr, "the cpuset controller isn't available in %s\n", root);
+			exit(1);
+		}
+		strcat(controllers, "+cpuset");
+	}
+
+	snprintf(group_base, sizeof(group_base), "%s/schbench.%d", root, getpid());
+	if (mkdir(group_base, 0755)) {
+		fprintf(stderr, "unable to make %s: %s\n", group_base, strerror(errno));
+		exit(1);
+	}
+	snprintf(val, sizeof(val), "%d", getpid());
+	write_cgroup_or_die(group_base, "cgroup.procs", val);
+	/*
+	 * the root we're under has to hand the controllers down to us.  If
+	 * something else still lives in it (a shell sharing our cgroup, say)
+	 * this is EBUSY, and nothing below can work
+	 */
+	write_cgroup_or_die(root, "cgroup.subtree_control", controllers);
+
+	for (i = 0; i < nr_groups; i++) {
+		struct worker_group *g = groups + i;
+		char dir[sizeof(g->dir)];
+
+		if (!group_needs_cgroup(g))
+			continue;
+		snprintf(dir, sizeof(dir), "%s/%.*s", group_base,
+			 GROUP_NAME_LEN, g->name);
+		if (mkdir(dir, 0755)) {
+			fprintf(stderr, "unable to make %s: %s\n", dir, strerror(errno));
+			cgroup_die();
+		}
+		/* only the ones we made, so teardown doesn't try the rest */
+		strcpy(g->dir, dir);
+		write_cgroup_or_die(g->dir, "cgroup.type", "threaded");
+	}
+	write_cgroup_or_die(group_base, "cgroup.subtree_control", controllers);
+
+	for (i = 0; i < nr_groups; i++) {
+		struct worker_group *g = groups + i;
+
+		if (!g->dir[0])
+			continue;
+		if (g->weight) {
+			snprintf(val, sizeof(val), "%d", g->weight);
+			write_cgroup_or_die(g->dir, "cpu.weight", val);
+		}
+		if (g->max[0])
+			write_cgroup_or_die(g->dir, "cpu.max", g->max);
+		if (g->cpus[0])
+			write_cgroup_or_die(g->dir, "cpuset.cpus", g->cpus);
+	}
+}
+
+/* called by each message thread before it starts its workers */
+static void join_group_cgroup(struct worker_group *g)
+{
+	char val[32];
+
+	if (!g || !g->dir[0])
+		return;
+	snprintf(val, sizeof(val), "%ld", (long)syscall(SYS_gettid));
+	write_cgroup_or_die(g->dir, "cgroup.threads", val);
+}
+
+/*
+ * glibc only grew struct sched_attr recently, this is the original
+ * 48 byte layout, which every kernel with sched_setattr() takes
+ */
+struct schbench_sched_attr {
+	uint32_t size;
+	uint32_t sched_policy;
+	uint64_t sched_flags;
+	int32_t sched_nice;
+	uint32_t sched_priority;
+	uint64_t sched_runtime;
+	uint64_t sched_deadline;
+	uint64_t sched_period;
+};
+
+static int sched_profile_empty(struct sched_profile *p)
+{
+	return p->policy < 0 && !p->has_nice && !p->slice;
+}
+
+/*
+ * apply a profile to the calling thread.  We start from whatever the
+ * thread has now so a profile with only nice= keeps the policy
+ */
+static void apply_sched_profile(struct sched_profile *p)
+{
+	struct schbench_sched_attr attr;
+	int ret;
+
+	if (sched_profile_empty(p))
+		return;
+
+	memset(&attr, 0, sizeof(attr));
+	ret = syscall(SYS_sched_getattr, 0, &attr, sizeof(attr), 0);
+	if (ret) {
+		perror("sched_getattr");
+		exit(1);
+	}
+	attr.size = sizeof(attr);
+	attr.sched_flags = 0;
+	if (p->policy >= 0)
+		attr.sched_policy = p->policy;
+	if (attr.sched_policy == SCHED_FIFO || attr.sched_policy == SCHED_RR)
+		attr.sched_priority = p->prio ? p->prio : 1;
+	else
+		attr.sched_priority = 0;
+	if (p->has_nice)
+		attr.sched_nice = p->nice;
+	/* the fair class takes sched_runtime as the slice */
+	if (p->slice)
+		attr.sched_runtime = p->slice * NSEC_PER_USEC;
+
+	ret = syscall(SYS_sched_setattr, 0, &attr, 0);
+	if (ret) {
+		fprintf(stderr, "unable to set policy %s prio %d nice %d slice %llu: %s\n",
+			sched_policy_name(attr.sched_policy), attr.sched_priority,
+			attr.sched_nice, p->slice, strerror(errno));
+		exit(1);
+	}
+}
+
+static void show_sched_profile(char *label, struct sched_profile *p)
+{
+	fprintf(stdout, "%s: policy %s", label,
+		p->policy >= 0 ? sched_policy_name(p->policy) : "inherited");
+	if (p->policy == SCHED_FIFO || p->policy == SCHED_RR)
+		fprintf(stdout, " prio %d", p->prio ? p->prio : 1);
+	if (p->has_nice)
+		fprintf(stdout, " nice %d", p->nice);
+	if (p->slice)
+		fprintf(stdout, " slice %llu usec", p->slice);
+	fprintf(stdout, "\n");
+}
+
+/*
+ * the hogs spin until we tell them to stop, then report how much cpu
+ * they managed to get
+ */
+struct hog {
+	pthread_t tid;
+	unsigned long long cpu_ns;
+	unsigned long long loops;
+};
+static struct hog *hogs = NULL;
+static volatile int hogs_stopping = 0;
+static unsigned long long hogs_start;
+static unsigned long long hogs_runtime;
+
+static void *hog_thread(void *arg)
+{
+	struct hog *hog = arg;
+	struct timespec ts;
+	volatile unsigned long sink = 0;
+	int i;
+
+	apply_sched_profile(&hog_sched);
+	while (!hogs_stopping) {
+		for (i = 0; i < 4096; i++)
+			sink += i;
+		hog->loops++;
+	}
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	hog->cpu_ns = ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+	return NULL;
+}
+
+static void start_hogs(void)
+{
+	pthread_attr_t attr;
+	int ret;
+	int i;
+
+	if (!nr_hogs)
+		return;
+	hogs = calloc(nr_hogs, sizeof(*hogs));
+	if (!hogs) {
+		perror("unable to allocate hogs");
+		exit(1);
+	}
+	pthread_attr_init(&attr);
+	if (hog_cpus_set)
+		pthread_attr_setaffinity_np(&attr, sizeof(hog_cpus), &hog_cpus);
+	hogs_start = nsec_now();
+	for (i = 0; i < nr_hogs; i++) {
+		ret = pthread_create(&hogs[i].tid, &attr, hog_thread, hogs + i);
+		if (ret) {
+			fprintf(stderr, "error %d from pthread_create\n", ret);
+			exit(1);
+		}
+	}
+	pthread_attr_destroy(&attr);
+}
+
+static void stop_hogs(void)
+{
+	int i;
+
+	if (!nr_hogs)
+		return;
+	hogs_stopping = 1;
+	for (i = 0; i < nr_hogs; i++)
+		pthread_join(hogs[i].tid, NULL);
+	hogs_runtime = nsec_now() - hogs_start;
+}
+
+/* the background mix the foreground numbers were measured against */
+static void show_hogs(void)
+{
+	unsigned long long cpu_ns = 0;
+	unsigned long long loops = 0;
+	int i;
+
+	if (!nr_hogs)
+		return;
+	for (i = 0; i < nr_hogs; i++) {
+		cpu_ns += hogs[i].cpu_ns;
+		loops += hogs[i].loops;
+	}
+	show_sched_profile("hogs", &hog_sched);
+	fprintf(stdout, "hogs: %d threads used %.2f cpus (%.1f%% each) loops %llu\n",
+		nr_hogs, (double)cpu_ns / hogs_runtime,
+		(double)cpu_ns * 100 / hogs_runtime / nr_hogs, loops);
+	free(hogs);
+}
+
+/* pull one counter out of a group's cpu.stat */
+static unsigned long long group_cpu_stat(struct worker_group *g, char *key)
+{
+	char path[sizeof(g->dir) + 16];
+	char name[64];
+	unsigned long long val;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/cpu.stat", g->dir);
+	fp = fopen(path, "r");
+	if (!fp)
+		return 0;
+	while (fscanf(fp, "%63s %llu", name, &val) == 2) {
+		if (!strcmp(name, key)) {
+			fclose(fp);
+			return val;
+		}
+	}
+	fclose(fp);
+	return 0;
+}
+
+static void show_auto_rps(struct auto_rps_state *s)
+{
+	if (s->fd >= 0) {
+		close(s->fd);
+		s->fd = -1;
+	}
+	if (s->converge_secs < 0) {
+		fprintf(stdout, "auto-rps: never settled within %.1f points of %d%% busy (%s)\n",
+			AUTO_RPS_BAND, auto_rps,
+			s->src == CPU_SRC_CGROUP ? "cgroup" : "/proc/stat");
+		return;
+	}
+	fprintf(stdout, "auto-rps: converged in %ld s, steady state error %.2f points (mean abs %.2f) over %lu samples (%s)\n",
+		s->converge_secs, s->err_sum / s->nr_err,
+		s->abs_err_sum / s->nr_err, s->nr_err,
+		s->src == CPU_SRC_CGROUP ? "cgroup" : "/proc/stat");
+}
+
+/*
+ * requests per second for this message thread.  Groups with their own
+ * rate split it over their message threads, everyone else gets -R (which
+ * main() already split up)
+ */
+static unsigned long long msg_rps(struct thread_data *td)
+{
+	struct worker_group *g = td->group;
+
+	if (g && g->rps)
+		return (g->rps + g->nr_msg - 1) / g->nr_msg;
+	return requests_per_sec;
+}
+
+/*
+ * once the message thread starts all his children, this is where he
+ * loops until our runtime is up.  Basically this sits around waiting
+ * for posting by the worker threads, replying to their messages after
+ * a delay of 'sleeptime' + some jitter.
+ */
+static void run_rps_thread(struct thread_data *td,
+			   struct thread_data *worker_threads_mem)
+{
+	/* number to wake at a time */
+	int nr_to_wake;
+	/* how many times we tried to wake up workers */
+	unsigned long total_wake_runs = 0;
+	/* list to record tasks waiting for work */
+	/* how many times do we need to batch wakeups per second */
+	int wakeups_required;
+	/* start of this batch of wakeups */
+	unsigned long long start;
+	struct request *request;
+
+	/* how long do we sleep between wakeup batches */
+	unsigned long sleep_time;
+	/* total number of times we kicked a worker */
+	unsigned long total_wakes = 0;
+	int cur_tid = 0;
+	int i;
+
+	while (1) {
+		nr_to_wake = active_workers * 2 / 3;
+		if (nr_to_wake < 1)
+			nr_to_wake = 1;
+		wakeups_required = (msg_rps(td) + nr_to_wake - 1) / nr_to_wake;
+		if (wakeups_required < 1)
+			wakeups_required = 1;
+		sleep_time = USEC_PER_SEC / wakeups_required;
+
+		/* start with a sleep to give everyone the chance to get going */
+		usleep(sleep_time);
+
+		start = nsec_now();
+
+		for (i = 0; i < nr_to_wake; i++) {
+			struct thread_data *worker;
+
+			worker = worker_threads_mem + cur_tid % active_workers;
+			cur_tid++;
+
+			/*
+			 * at some point, there's just too much, don't queue more.
+			 * The pool size caps how far behind a worker can get
+			 */
+			request = allocate_request(worker);
+			if (!request) {
+				worker->pool_exhausted++;
+				continue;
+			}
+			queue_request(worker, request, start);
+			total_wakes++;
+		}
+		total_wake_runs++;
+
+		if (stopping) {
+			for (i = 0; i < worker_threads; i++)
+				fpost(worker_threads_mem + i);
+			break;
+		}
+
+	}
+	fprintf(stderr, "final rps was %llu\n", msg_rps(td));
+}
+
+/* nsecs until the next request should arrive */
+static unsigned long long next_arrival(struct thread_data *td)
+{
+	unsigned long long rps = msg_rps(td);
+	double mean;
+
+	/* auto-rps can walk us all the way down to zero */
+	if (rps == 0)
+		rps = 1;
+	mean = (double)NSEC_PER_SEC / rps;
+
+	if (arrivals == ARRIVALS_POISSON)
+		return -log(rand_unit(&td->rng)) * mean;
+	return mean;
+}
+
+/* don't sleep so long we miss the end of the run */
+#define PACER_MAX_SLEEP (100 * 1000 * 1000ULL)
+
+static void pacer_sleep(unsigned long long sleep_ns)
+{
+	struct timespec ts;
+
+	if (sleep_ns > PACER_MAX_SLEEP)
+		sleep_ns = PACER_MAX_SLEEP;
+	ts.tv_sec = sleep_ns / NSEC_PER_SEC;
+	ts.tv_nsec = sleep_ns % NSEC_PER_SEC;
+	nanosleep(&ts, NULL);
+}
+
+/*
+ * open loop arrivals that found every worker's pool empty.  Dropping them
+ * would leave exactly the slow part out of the latencies, so they wait
+ * here with their intended time and go out as soon as any worker frees a
+ * request.  Only the dispatcher touches it.  Past BACKLOG_MAX we give up
+ * and drop, and the final report says the percentiles can't be trusted
+ */
+#define BACKLOG_MAX (1UL << 24)
+/* how often to look for free requests while the backlog isn't empty */
+#define BACKLOG_POLL (20 * 1000ULL)
+
+struct backlog_entry {
+	unsigned long long intended_time;
+	unsigned long long service;
+	int class;
+};
+
+struct backlog {
+	struct backlog_entry *ents;
+	/* ring indexes, size is a power of two */
+	unsigned long head;
+	unsigned long tail;
+	unsigned long size;
+};
+
+static unsigned long backlog_len(struct backlog *bl)
+{
+	return bl->tail - bl->head;
+}
+
+/* returns -1 if the backlog is full and the arrival has to be dropped */
+static int backlog_push(struct backlog *bl, unsigned long long intended_time,
+			unsigned long long service, int class)
+{
+	struct backlog_entry *ent;
+	unsigned long len = backlog_len(bl);
+	unsigned long i;
+
+	if (len == bl->size) {
+		unsigned long size = bl->size ? bl->size * 2 : 1024;
+		struct backlog_entry *ents;
+
+		if (size > BACKLOG_MAX)
+			return -1;
+		ents = malloc(size * sizeof(*ents));
+		if (!ents) {
+			perror("unable to allocate request backlog");
+			exit(1);
+		}
+		for (i = 0; i < len; i++)
+			ents[i] = bl->ents[(bl->head + i) & (bl->size - 1)];
+		free(bl->ents);
+		bl->ents = ents;
+		bl->head = 0;
+		bl->tail = len;
+		bl->size = size;
+	}
+	ent = bl->ents + (bl->tail++ & (bl->size - 1));
+	ent->intended_time = intended_time;
+	ent->service = service;
+	ent->class = class;
+	return 0;
+}
+
+/*
+ * give the arrival to the next worker in line with a free request.
+ * Returns 0 if every pool is empty
+ */
+static int dispatch_arrival(struct thread_data *worker_threads_mem, int *cur_tid,
+			    unsigned long long intended_time,
+			    unsigned long long service, int class,
+			    unsigned long long now)
+{
+	struct thread_data *worker;
+	struct request *request;
+	int i;
+
+	for (i = 0; i < active_workers; i++) {
+		worker = worker_threads_mem + (*cur_tid)++ % active_workers;
+		request = allocate_request(worker);
+		if (!request)
+			continue;
+		request->intended_time = intended_time;
+		request->service = service;
+		request->class = class;
+		queue_request(worker, request, now);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * send a new arrival out, behind anything already waiting.  class is -1
+ * for -c or -n work
+ */
+static void pace_arrival(struct thread_data *td,
+			 struct thread_data *worker_threads_mem,
+			 struct backlog *bl, int *cur_tid,
+			 unsigned long long intended_time,
+			 unsigned long long service, int class,
+			 unsigned long long now)
+{
+	if (!backlog_len(bl) &&
+	    dispatch_arrival(worker_threads_mem, cur_tid, intended_time,
+			     service, class, now))
+		return;
+	td->backlogged++;
+	if (backlog_push(bl, intended_time, service, class))
+		td->backlog_dropped++;
+}
+
+/* send out as much of the backlog as the workers have room for */
+static void drain_backlog(struct thread_data *worker_threads_mem,
+			  struct backlog *bl, int *cur_tid)
+{
+	struct backlog_entry *ent;
+	unsigned long long now = nsec_now();
+
+	while (backlog_len(bl)) {
+		ent = bl->ents + (bl->head & (bl->size - 1));
+		if (!dispatch_arrival(worker_threads_mem, cur_tid,
+				      ent->intended_time, ent->service,
+				      ent->class, now))
+			break;
+		bl->head++;
+	}
+}
+
+/* whatever is still waiting at the end never got served, it's dropped */
+static void free_backlog(struct thread_data *td, struct backlog *bl)
+{
+	td->backlog_dropped += backlog_len(bl);
+	free(bl->ents);
+	memset(bl, 0, sizeof(*bl));
+}
+
+/* sleep until the next arrival, or until it's time to retry the backlog */
+static void pacer_wait(struct backlog *bl, unsigned long long sleep_ns)
+{
+	if (backlog_len(bl) && sleep_ns > BACKLOG_POLL)
+		sleep_ns = BACKLOG_POLL;
+	pacer_sleep(sleep_ns);
+}
+
+/*
+ * read the --trace.  We map the file rather than reading it, traces of
+ * long incidents get big.  One loop lasts until the last arrival plus
+ * the average gap, so a looped trace doesn't double up at the seam.
+ * We also set requests_per_sec to the trace's average rate, which is
+ * what turns on RPS mode
+ */
+static void load_trace(void)
+{
+	unsigned long long offset, service;
+	unsigned long long last = 0;
+	unsigned long alloced = 0;
+	unsigned long lineno = 0;
+	struct stat st;
+	char line[256];
+	char *map, *p, *q, *end, *eol;
+	size_t len;
+	int class;
+	int fd;
+
+	fd = open(trace_path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		perror(trace_path);
+		exit(1);
+	}
+	if (!st.st_size) {
+		fprintf(stderr, "%s is empty\n", trace_path);
+		exit(1);
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("unable to map trace");
+		exit(1);
+	}
+	close(fd);
+
+	end = map + st.st_size;
+	for (p = map; p < end; p = eol + 1) {
+		eol = memchr(p, '\n', end - p);
+		if (!eol)
+			eol = end;
+		lineno++;
+		len = eol - p;
+		if (len >= sizeof(line))
+			len = sizeof(line) - 1;
+		memcpy(line, p, len);
+		line[len] = '\0';
+
+		/* blank lines and comments */
+		class = 0;
+		q = line + strspn(line, " \t\r");
+		if (!*q || *q == '#')
+			continue;
+		if (sscanf(line, "%llu %llu %d", &offset, &service, &class) < 2 ||
+		    class < 0 || class >= MAX_TRACE_CLASSES) {
+			fprintf(stderr, "%s:%lu: want 'offset_usec service_usec [class 0-%d]'\n",
+				trace_path, lineno, MAX_TRACE_CLASSES - 1);
+			exit(1);
+		}
+		offset *= NSEC_PER_USEC;
+		if (offset < last) {
+			fprintf(stderr, "%s:%lu: offsets have to be in order\n",
+				trace_path, lineno);
+			exit(1);
+		}
+		last = offset;
+
+		if (nr_trace == alloced) {
+			alloced = alloced ? alloced * 2 : 4096;
+			trace = realloc(trace, alloced * sizeof(*trace));
+			if (!trace) {
+				perror("unable to allocate trace");
+				exit(1);
+			}
+		}
+		trace[nr_trace].offset = offset;
+		trace[nr_trace].service = service;
+		trace[nr_trace].class = class;
+		nr_trace++;
+		if (class >= trace_classes)
+			trace_classes = class + 1;
+	}
+	munmap(map, st.st_size);
+
+	if (!nr_trace) {
+		fprintf(stderr, "no requests in %s\n", trace_path);
+		exit(1);
+	}
+	trace_duration = last + (nr_trace > 1 ? last / (nr_trace - 1) : NSEC_PER_MSEC);
+	if (!trace_duration)
+		trace_duration = NSEC_PER_MSEC;
+	requests_per_sec = llround(nr_trace * trace_speed * NSEC_PER_SEC / trace_duration);
+	if (!requests_per_sec)
+		requests_per_sec = 1;
+	fprintf(stderr, "trace %s: %lu requests over %.3f s, %d classes, %llu rps at %.2fx\n",
+		trace_path, nr_trace, (double)trace_duration / NSEC_PER_SEC,
+		trace_classes, requests_per_sec, trace_speed);
+}
+
+/*
+ * --trace version of run_paced_rps_thread().  Message thread N replays
+ * every message_threads'th request starting at N, so all of them together
+ * replay the whole trace at its own rate.  Arrival times are scaled by
+ * --trace-speed and stamped as each request's intended time
+ */
+static void run_trace_thread(struct thread_data *td,
+			     struct thread_data *worker_threads_mem)
+{
+	struct backlog bl = { NULL, 0, 0, 0 };
+	struct trace_entry *ent;
+	unsigned long long start;
+	unsigned long long loop_start = 0;
+	unsigned long long next;
+	unsigned long long now;
+	unsigned long idx = td->msg_index;
+	int cur_tid = 0;
+	int done = 0;
+	int i;
+
+	prctl(PR_SET_TIMERSLACK, 1, 0, 0, 0);
+
+	start = nsec_now();
+	while (!stopping) {
+		drain_backlog(worker_threads_mem, &bl, &cur_tid);
+		if (done) {
+			pacer_wait(&bl, PACER_MAX_SLEEP);
+			continue;
+		}
+		if (idx >= nr_trace) {
+			if (!trace_loop) {
+				if (td->msg_index == 0)
+					fprintf(stderr, "trace finished after %.3f s\n",
+						(double)nsdelta(start, nsec_now()) / NSEC_PER_SEC);
+				done = 1;
+				continue;
+			}
+			idx -= nr_trace;
+			loop_start += trace_duration;
+		}
+		ent = trace + idx;
+		next = start + (loop_start + ent->offset) / trace_speed;
+		now = nsec_now();
+		if (next > now) {
+			pacer_wait(&bl, next - now);
+			continue;
+		}
+
+		record_pacer_lag(td, now - next);
+		pace_arrival(td, worker_threads_mem, &bl, &cur_tid, next,
+			     ent->service, ent->class, now);
+		idx += message_threads;
+	}
+	free_backlog(td, &bl);
+
+	for (i = 0; i < worker_threads; i++)
+		fpost(worker_threads_mem + i);
+}
+
+/*
+ * open loop version of run_rps_thread().  Every request gets an intended
+ * arrival time from a fixed or poisson schedule that never waits for the
+ * workers or for the dispatcher.  If we wake up late, everything that
+ * should have arrived in the meantime goes out at once with its original
+ * intended time, so the delay shows up in the request latencies instead of
+ * quietly stretching the schedule.
+ *
+ * How far behind the schedule we dispatch each request goes into the
+ * message thread's own histogram, which is otherwise unused in RPS mode.
+ */
+static void run_paced_rps_thread(struct thread_data *td,
+				 struct thread_data *worker_threads_mem)
+{
+	struct backlog bl = { NULL, 0, 0, 0 };
+	unsigned long long next;
+	unsigned long long now;
+	int cur_tid = 0;
+	int i;
+
+	/* the default 50us of timer slack is longer than most gaps */
+	prctl(PR_SET_TIMERSLACK, 1, 0, 0, 0);
+
+	next = nsec_now() + next_arrival(td);
+	while (!stopping) {
+		drain_backlog(worker_threads_mem, &bl, &cur_tid);
+		now = nsec_now();
+		if (next > now) {
+			pacer_wait(&bl, next - now);
+			continue;
+		}
+
+		while (next <= now) {
+			record_pacer_lag(td, now - next);
+			pace_arrival(td, worker_threads_mem, &bl, &cur_tid, next,
+				     0, -1, now);
+			next += next_arrival(td);
+		}
+	}
+	free_backlog(td, &bl);
+
+	for (i = 0; i < worker_threads; i++)
+		fpost(worker_threads_mem + i);
+	fprintf(stderr, "final rps was %llu\n", msg_rps(td));
+}
+
+/*
+ * multiply two matrices in a naive way to emulate some cache footprint
+ */
+static void do_some_math(struct thread_data *thread_data)
+{
+	unsigned long i, j, k;
+	unsigned long *m1, *m2, *m3;
+	unsigned long *data = thread_data->data;
+
+	m1 = &data[0];
+	m2 = &data[matrix_size * matrix_size];
+	m3 = &data[2 * matrix_size * matrix_size];
+
+	for (i = 0; i < matrix_size; i++) {
+		for (j = 0; j < matrix_size; j++) {
+			m3[i * matrix_size + j] = 0;
+
+			for (k = 0; k < matrix_size; k++)
+				m3[i * matrix_size + j] +=
+					m1[i * matrix_size + k] *
+					m2[k * matrix_size + j];
+		}
+	}
+}
+
+/*
+ * the other --kernels.  They all work over -F kb per worker, and each of
+ * the -n operations is one full pass over it.  The working set stays put
+ * between requests, so a worker that got moved to a cold CPU pays for
+ * refilling the caches in its service time
+ */
+
+/* one node per cacheline, so every step of the chase is a fresh line */
+struct chase_node {
+	struct chase_node *next;
+	unsigned long pad[7];
+};
+
+#define BLOCK_DIM 32
+/* gcc picks the best instructions it can for these, or splits them up */
+typedef double vdouble __attribute__((vector_size(4 * sizeof(double))));
+#define VDOUBLE_LEN (sizeof(vdouble) / sizeof(double))
+
+/* the hash kernel table is half full, and half the probes miss */
+#define HASH_EMPTY 0
+#define HASH_PROBES_PER_PASS(slots) ((slots) / 4)
+
+static unsigned long hash_key(unsigned long i)
+{
+	/* odd keys are in the table, even keys never are */
+	return ((i * 0x9E3779B97F4A7C15UL) | 1);
+}
+
+static unsigned long hash_slot(unsigned long key)
+{
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdUL;
+	key ^= key >> 33;
+	return key & (kernel_elems - 1);
+}
+
+static void *alloc_kernel_data(size_t bytes)
+{
+	void *p;
+
+	if (posix_memalign(&p, 64, bytes)) {
+		perror("unable to allocate ram");
+		exit(1);
+	}
+	memset(p, 0, bytes);
+	return p;
+}
+
+/* random single cycle through all the nodes, Sattolo's shuffle */
+static void chase_init(struct thread_data *td)
+{
+	struct chase_node *nodes = alloc_kernel_data(kernel_elems * sizeof(*nodes));
+	unsigned long *order = malloc(kernel_elems * sizeof(*order));
+	unsigned long i, j, tmp;
+
+	if (!order) {
+		perror("unable to allocate ram");
+		exit(1);
+	}
+	for (i = 0; i < kernel_elems; i++)
+		order[i] = i;
+	for (i = kernel_elems - 1; i > 0; i--) {
+		j = rng_below(&td->rng, i);
+		tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+	for (i = 0; i < kernel_elems; i++)
+		nodes[order[i]].next = &nodes[order[(i + 1) % kernel_elems]];
+	free(order);
+	td->data = nodes;
+	td->kernel_pos = nodes;
+}
+
+static void chase_run(struct thread_data *td)
+{
+	struct chase_node *node = td->kernel_pos;
+	unsigned long i;
+
+	for (i = 0; i < kernel_elems; i++)
+		node = node->next;
+	td->kernel_pos = node;
+}
+
+static void stream_init(struct thread_data *td)
+{
+	td->data = alloc_kernel_data(kernel_elems * sizeof(unsigned long));
+}
+
+/* read and write every word, the prefetchers should love this one */
+static void stream_run(struct thread_data *td)
+{
+	unsigned long *a = td->data;
+	unsigned long sum = 0;
+	unsigned long i;
+
+	for (i = 0; i < kernel_elems; i++) {
+		sum += a[i];
+		a[i] = sum;
+	}
+	td->kernel_sink += sum;
+}
+
+static void matmul_init(struct thread_data *td)
+{
+	td->data = alloc_kernel_data(3 * sizeof(unsigned long) * matrix_size * matrix_size);
+}
+
+static void matmul_run(struct thread_data *td)
+{
+	do_some_math(td);
+}
+
+/*
+ * square double matrices, the size is a multiple of BLOCK_DIM so the
+ * blocks tile evenly and every row is vector aligned
+ */
+static void blocked_matmul_init(struct thread_data *td)
+{
+	double *m;
+	unsigned long i;
+
+	m = alloc_kernel_data(3 * sizeof(double) * matrix_size * matrix_size);
+	for (i = 0; i < 2 * matrix_size * matrix_size; i++)
+		m[i] = (double)(i % 7) / 7;
+	td->data = m;
+}
+
+static void blocked_matmul_run(struct thread_data *td)
+{
+	unsigned long n = matrix_size;
+	double *m1 = td->data;
+	double *m2 = m1 + n * n;
+	double *m3 = m2 + n * n;
+	unsigned long ii, jj, kk, i, j, k;
+
+	memset(m3, 0, n * n * sizeof(double));
+	for (ii = 0; ii < n; ii += BLOCK_DIM) {
+		for (kk = 0; kk < n; kk += BLOCK_DIM) {
+			for (jj = 0; jj < n; jj += BLOCK_DIM) {
+				for (i = ii; i < ii + BLOCK_DIM; i++) {
+					vdouble *c = (vdouble *)&m3[i * n + jj];
+
+					for (k = kk; k < kk + BLOCK_DIM; k++) {
+						double a = m1[i * n + k];
+						vdouble *b = (vdouble *)&m2[k * n + jj];
+
+						for (j = 0; j < BLOCK_DIM / VDOUBLE_LEN; j++)
+							c[j] += a * b[j];
+					}
+				}
+			}
+		}
+	}
+}
+
+static void hash_init(struct thread_data *td)
+{
+	unsigned long *table = alloc_kernel_data(kernel_elems * sizeof(unsigned long));
+	unsigned long i, slot, key;
+
+	for (i = 0; i < kernel_elems / 2; i++) {
+		key = hash_key(i);
+		slot = hash_slot(key);
+		while (table[slot] != HASH_EMPTY)
+			slot = (slot + 1) & (kernel_elems - 1);
+		table[slot] = key;
+	}
+	td->data = table;
+}
+
+/* linear probing, a mix of hits and misses spread over the whole table */
+static void hash_run(struct thread_data *td)
+{
+	unsigned long *table = td->data;
+	unsigned long probes = HASH_PROBES_PER_PASS(kernel_elems);
+	unsigned long hits = 0;
+	unsigned long i, slot, key, r;
+
+	for (i = 0; i < probes; i++) {
+		r = rng_below(&td->rng, kernel_elems / 2);
+		key = (r & 1) ? hash_key(r) : hash_key(r) + 1;
+		slot = hash_slot(key);
+		while (table[slot] != HASH_EMPTY) {
+			if (table[slot] == key) {
+				hits++;
+				break;
+			}
+			slot = (slot + 1) & (kernel_elems - 1);
+		}
+	}
+	td->kernel_sink += hits;
+}
+
+struct kernel_ops {
+	void (*init)(struct thread_data *td);
+	void (*run)(struct thread_data *td);
+};
+
+static struct kernel_ops kernel_ops[] = {
+	[KERNEL_MATMUL] = { matmul_init, matmul_run },
+	[KERNEL_CHASE] = { chase_init, chase_run },
+	[KERNEL_STREAM] = { stream_init, stream_run },
+	[KERNEL_BLOCKED_MATMUL] = { blocked_matmul_init, blocked_matmul_run },
+	[KERNEL_HASH] = { hash_init, hash_run },
+};
+
+/* turn -F into the size of whatever the --kernel works on */
+static void size_kernel(void)
+{
+	unsigned long bytes = cache_footprint_kb * 1024;
+	unsigned long n;
+
+	switch (work_kernel) {
+	case KERNEL_MATMUL:
+		matrix_size = sqrt(bytes / 3 / sizeof(unsigned long));
+		break;
+	case KERNEL_BLOCKED_MATMUL:
+		n = sqrt(bytes / 3 / sizeof(double));
+		n = (n / BLOCK_DIM) * BLOCK_DIM;
+		matrix_size = n ? n : BLOCK_DIM;
+		break;
+	case KERNEL_CHASE:
+		kernel_elems = bytes / sizeof(struct chase_node);
+		break;
+	case KERNEL_STREAM:
+		kernel_elems = bytes / sizeof(unsigned long);
+		break;
+	case KERNEL_HASH:
+		/* power of two slots for the mask, at least a few to probe */
+		n = bytes / sizeof(unsigned long);
+		kernel_elems = 4;
+		while (kernel_elems * 2 <= n)
+			kernel_elems *= 2;
+		break;
+	}
+	if (work_kernel != KERNEL_MATMUL && work_kernel != KERNEL_BLOCKED_MATMUL &&
+	    kernel_elems < 2)
+		kernel_elems = 2;
+}
+
+/*
+ * spin or run a few passes of the --kernel
+ */
+static void do_work(struct thread_data *td)
+{
+	if (operations) {
+		unsigned long i;
+
+		for (i = 0; i < operations; i++)
+			kernel_ops[work_kernel].run(td);
+	} else {
+		td->spin = service_usecs(td);
+		usec_spin(td, td->spin);
+	}
+}
+
+/*
+ * run one RPS request and record how long it took from its intended
+ * arrival.  The queue and service histograms split that into the time
+ * before we picked it up and the time we spent working on it
+ */
+static void process_request(struct thread_data *td, struct request *req,
+			    unsigned long long start)
+{
+	unsigned long long begin;
+	unsigned long long now;
+	int locality = -1;
+
+	if (placement)
+		locality = wake_locality(req->wake_cpu, sched_getcpu());
+
+	begin = nsec_now();
+	if (req->class >= 0) {
+		int i;
+
+		usec_spin(td, req->service);
+		for (i = 0; operations && i < req->class; i++)
+			kernel_ops[work_kernel].run(td);
+	} else {
+		do_work(td);
+	}
+	now = nsec_now();
+
+	td->runtime = nsdelta(start, now);
+	record_lat(td, nsdelta(req->intended_time, now), spin_usecs(td, req), locality);
+	if (req->class >= 0) {
+		unsigned long long lat = nsdelta(req->intended_time, now);
+
+		lat = lat > req->service * NSEC_PER_USEC ?
+			lat - req->service * NSEC_PER_USEC : 1;
+		record_extra_lat(td, LAT_CLASS0 + req->class, lat);
+	}
+	record_extra_lat(td, LAT_QUEUE, nsdelta(req->intended_time, begin));
+	record_extra_lat(td, LAT_SERVICE, nsdelta(begin, now));
+
+	free_request(req);
+	td->loop_count++;
+}
+
+/*
+ * --slo-search parks the workers it isn't using instead of tearing the
+ * threads down.  Anything already handed to us gets finished first, and
+ * the search fposts everyone when it changes active_workers
+ */
+static int worker_parked(struct thread_data *td)
+{
+	return td - (td->msg_thread + 1) >= active_workers;
+}
+
+static void park_worker(struct thread_data *td, unsigned long long start)
+{
+	struct request *req;
+	struct request *tmp;
+
+	if (requests_per_sec) {
+		if (steal) {
+			while ((req = deque_take(&td->deque)) != NULL)
+				process_request(td, req, start);
+		}
+		req = request_splice(td);
+		while (req) {
+			tmp = req->next;
+			process_request(td, req, start);
+			req = tmp;
+		}
+	}
+	td->futex = FUTEX_BLOCKED;
+	__sync_synchronize();
+	if (stopping || !worker_parked(td)) {
+		td->futex = FUTEX_RUNNING;
+		return;
+	}
+	fwait(td);
+}
+
+/*
+ * -p buffers are allocated by the thread that owns them, so they land on
+ * its node.  The message thread only touches a worker's buffer after the
+ * worker has queued itself, which is well after this.  They're page
+ * aligned so vmsplice gifts exactly the pages vmsplice_chan_init()
+ * sized the pipes for
+ */
+static void alloc_pipe_page(struct thread_data *td)
+{
+	int ret;
+
+	if (!pipe_test)
+		return;
+	ret = posix_memalign((void **)&td->pipe_page, sysconf(_SC_PAGESIZE),
+			     pipe_test);
+	if (ret) {
+		errno = ret;
+		perror("unable to allocate pipe buffer");
+		exit(1);
+	}
+	memset(td->pipe_page, 0, pipe_test);
+}
+
+/* what the message thread hands a worker it is starting */
+struct worker_start {
+	struct thread_data *td;
+	struct thread_data *msg_thread;
+	int index;
+	/* set once the worker is done with this, see worker_setup() */
+	int ready;
+};
+
+/*
+ * a worker fills in its own thread_data and allocates everything it
+ * records into, so the first touch of all of it is from the cpu
+ * --placement pinned us to.  The message thread waits for ->ready
+ * before it looks at any of it
+ */
+static struct thread_data *worker_setup(struct worker_start *ws)
+{
+	struct thread_data *td = ws->td;
+	struct thread_data *msg = ws->msg_thread;
+
+	td->tid = pthread_self();
+	td->msg_thread = msg;
+	td->msg_index = msg->msg_index;
+	td->group = msg->group;
+	td->cputime = msg->cputime;
+	rng_init(&td->rng, msg->msg_index * (worker_threads + 1) + ws->index + 1);
+
+	td->lat_stats[LAT_TOTAL] = &td->stats;
+	if (requests_per_sec)
+		alloc_request_pool(td);
+	if (breakdown)
+		alloc_lat_stats(td, LAT_WAKEUP);
+	if (breakdown || steal) {
+		alloc_lat_stats(td, LAT_QUEUE);
+		alloc_lat_stats(td, LAT_SERVICE);
+	}
+	if (placement) {
+		int j;
+
+		for (j = LAT_SAME_CORE; j <= LAT_CROSS_NODE; j++)
+			alloc_lat_stats(td, j);
+	}
+	if (stall_thresh_ns)
+		alloc_lat_stats(td, LAT_STALL);
+	if (trace) {
+		int j;
+
+		for (j = 0; j < trace_classes; j++)
+			alloc_lat_stats(td, LAT_CLASS0 + j);
+	}
+	wake_init(td);
+	transport_init(td);
+	alloc_pipe_page(td);
+	if (operations)
+		kernel_ops[work_kernel].init(td);
+
+	/* ws lives on the message thread's stack, it's gone after this */
+	__atomic_store_n(&ws->ready, 1, __ATOMIC_RELEASE);
+	futex(&ws->ready, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	return td;
+}
+
+/*
+ * the worker thread is pretty simple, it just does a single spin and
+ * then waits on a message from the message thread
+ */
+void *worker_thread(void *arg)
+{
+	struct thread_data *td;
+	unsigned long long now;
+	unsigned long long start;
+	unsigned long long delta;
+	struct request *req = NULL;
+	int locality = -1;
+
+	td = worker_setup(arg);
+	/* slices aren't reliably inherited, so set the whole profile again */
+	if (td->group)
+		apply_sched_profile(&td->group->sched);
+	__atomic_store_n(&td->task_id, (pid_t)syscall(SYS_gettid), __ATOMIC_RELEASE);
+	start = nsec_now();
+	while(1) {
+		if (stopping)
+			break;
+
+		if (worker_parked(td)) {
+			park_worker(td, start);
+			continue;
+		}
+
+		if (steal) {
+			req = next_request(td);
+			if (req)
+				process_request(td, req, start);
+			else
+				wait_for_request(td);
+			continue;
+		}
+
+		req = msg_and_wait(td);
+		if (placement && !requests_per_sec)
+			locality = wake_locality(td->wake_cpu, sched_getcpu());
+		if (requests_per_sec) {
+			while (req) {
+				struct request *tmp = req->next;
+
+				process_request(td, req, start);
+				req = tmp;
+			}
+		} else {
+			unsigned long long begin = nsec_now();
+
+			do_work(td);
+			td->loop_count++;
+			now = nsec_now();
+			td->runtime = nsdelta(start, now);
+			record_extra_lat(td, LAT_SERVICE, nsdelta(begin, now));
+		}
+
+		if (!requests_per_sec) {
+			now = nsec_now();
+			delta = nsdelta(td->wake_time, now);
+			if (delta > 0)
+				record_lat(td, delta, spin_usecs(td, NULL), locality);
+		}
+	}
+	now = nsec_now();
+	td->runtime = nsdelta(start, now);
+
+	return NULL;
+}
+
+/*
+ * the message thread starts his own gaggle of workers and then sits around
+ * replying when they post him.  He collects latency stats as all the threads
+ * exit
+ */
+void *message_thread(void *arg)
+{
+	struct thread_data *td = arg;
+	struct thread_data *worker_threads_mem = NULL;
+	int i;
+	int ret;
+
+	worker_threads_mem = td + 1;
+	join_group_cgroup(td->group);
+	alloc_pipe_page(td);
+	if (td->group)
+		apply_sched_profile(&td->group->sched);
+
+	if (!worker_threads_mem) {
+		perror("unable to allocate ram");
+		pthread_exit((void *)-ENOMEM);
+	}
+
+	/* the workers set themselves up, we don't touch their pages first */
+	for (i = 0; i < worker_threads; i++) {
+		struct worker_start ws = {
+			.td = worker_threads_mem + i,
+			.msg_thread = td,
+			.index = i,
+		};
+		pthread_t tid;
+
+		ret = create_placed_thread(&tid, td->msg_index, i, worker_thread, &ws);
+		if (ret) {
+			fprintf(stderr, "error %d from pthread_create\n", ret);
+			exit(1);
+		}
+		while (!__atomic_load_n(&ws.ready, __ATOMIC_ACQUIRE))
+			futex(&ws.ready, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0);
+	}
+
+	if (trace)
+		run_trace_thread(td, worker_threads_mem);
+	else if (requests_per_sec && arrivals != ARRIVALS_BATCH)
+		run_paced_rps_thread(td, worker_threads_mem);
+	else if (requests_per_sec)
+		run_rps_thread(td, worker_threads_mem);
+	else
+		run_msg_thread(td);
+
+	for (i = 0; i < worker_threads; i++)
+		transport_close_msg(worker_threads_mem + i);
+	for (i = 0; i < worker_threads; i++) {
+		fpost(worker_threads_mem + i);
+		pthread_join(worker_threads_mem[i].tid, NULL);
+		free_request_pool(worker_threads_mem + i);
+		free(worker_threads_mem[i].data);
+		free(worker_threads_mem[i].pipe_page);
+		wake_cleanup(worker_threads_mem + i);
+		transport_cleanup(worker_threads_mem + i);
+	}
+	free(td->pipe_page);
+	return NULL;
+}
+
+static char *units[] = { "B", "KB", "MB", "GB", "TB", "PB", "EB", NULL};
+
+static double pretty_size(double number, char **str)
+{
+	int divs = 0;
+
+	while(number >= 1024) {
+		if (units[divs + 1] == NULL)
+			break;
+		divs++;
+		number /= 1024;
+	}
+	*str = units[divs];
+	return number;
+}
+
+/*
+ * the sum of every worker's histogram at the time of the last reset.  The
+ * workers never zero their own stats, we subtract this instead
  */
-static struct request *msg_and_wait(struct thread_data *td)
+static struct stats base_stats[NR_LAT_STATS];
+
+/*
+ * sum up one of the raw worker histograms, including samples from before
+ * the reset.  Returns zero if the workers aren't recording that one
+ */
+static int snapshot_group_stats(struct stats *stats,
+				struct thread_data *thread_data,
+				int which, struct worker_group *group)
 {
-	struct request *req;
+	struct thread_data *worker;
+	struct stats snap;
+	int found = 0;
+	int i;
+	int msg_i;
+	int index = 0;
 
-	if (pipe_test)
-		memset(td->pipe_page, 2, pipe_test);
+	for (msg_i = 0; msg_i < message_threads; msg_i++) {
+		index++;
+		for (i = 0; i < worker_threads; i++) {
+			worker = thread_data + index++;
+			if (!worker->lat_stats[which])
+				continue;
+			if (group && worker->group != group)
+				continue;
+			snapshot_stats(worker, which, &snap);
+			combine_stats(stats, &snap);
+			found = 1;
+		}
+	}
+	return found;
+}
 
-	/* set ourselves to blocked */
-	td->futex = FUTEX_BLOCKED;
-	gettimeofday(&td->wake_time, NULL);
+/* snapshot one of the histograms across every worker */
+static int snapshot_message_thread_stats(struct stats *stats,
+					 struct thread_data *thread_data,
+					 int which)
+{
+	return snapshot_group_stats(stats, thread_data, which, NULL);
+}
 
-	/* add us to the list */
-	if (requests_per_sec) {
-		td->pending = 0;
-		req = request_splice(td);
-		if (req) {
-			td->futex = FUTEX_RUNNING;
-			return req;
+/* fill in each group's ->final latencies since the last reset */
+static void combine_group_stats(struct thread_data *thread_data)
+{
+	int i;
+
+	for (i = 0; i < nr_groups; i++) {
+		memset(groups[i].final, 0, sizeof(struct stats));
+		snapshot_group_stats(groups[i].final, thread_data, LAT_TOTAL,
+				     groups + i);
+		subtract_stats(groups[i].final, groups[i].base);
+	}
+}
+
+/* collect one of the histograms since the last reset */
+static int combine_lat_stats(struct stats *stats,
+			     struct thread_data *thread_data, int which)
+{
+	if (!snapshot_message_thread_stats(stats, thread_data, which))
+		return 0;
+	subtract_stats(stats, &base_stats[which]);
+	return 1;
+}
+
+/* fill in the --breakdown histograms in extra, which is indexed by LAT_* */
+static void combine_breakdown_stats(struct stats *extra,
+				    struct thread_data *thread_data)
+{
+	unsigned int col;
+	int which;
+
+	for (col = 0; col < NR_BREAKDOWN_COLS; col++) {
+		which = breakdown_cols[col];
+		memset(&extra[which], 0, sizeof(extra[which]));
+		combine_lat_stats(&extra[which], thread_data, which);
+	}
+}
+
+/* drop the optional histograms once we're done reporting */
+static void free_thread_stats(struct thread_data *thread_data)
+{
+	int i;
+	int msg_i;
+	int index = 0;
+
+	for (msg_i = 0; msg_i < message_threads; msg_i++) {
+		index++;
+		for (i = 0; i < worker_threads; i++)
+			free_lat_stats(thread_data + index++);
+	}
+}
+
+/* total requests the --steal workers took from their siblings */
+static unsigned long total_steals(struct thread_data *thread_data)
+{
+	unsigned long total = 0;
+	int i;
+	int msg_i;
+	int index = 0;
+
+	for (msg_i = 0; msg_i < message_threads; msg_i++) {
+		index++;
+		for (i = 0; i < worker_threads; i++)
+			total += thread_data[index++].steals;
+	}
+	return total;
+}
+
+/* how many requests got dropped because a worker's pool was empty */
+static unsigned long total_pool_exhausted(struct thread_data *thread_data)
+{
+	unsigned long total = 0;
+	int i;
+	int msg_i;
+	int index = 0;
+
+	for (msg_i = 0; msg_i < message_threads; msg_i++) {
+		index++;
+		for (i = 0; i < worker_threads; i++)
+			total += thread_data[index++].pool_exhausted;
+	}
+	return total;
+}
+
+/* arrivals the paced dispatchers had to hold until a request was free */
+static unsigned long total_backlogged(struct thread_data *thread_data)
+{
+	unsigned long total = 0;
+	int msg_i;
+
+	for (msg_i = 0; msg_i < message_threads; msg_i++)
+		total += thread_data[msg_i * worker_threads + msg_i].backlogged;
+	return total;
+}
+
+/* arrivals the paced dispatchers dropped from their backlog */
+static unsigned long total_backlog_dropped(struct thread_data *thread_data)
+{
+	unsigned long total = 0;
+	int msg_i;
+
+	for (msg_i = 0; msg_i < message_threads; msg_i++)
+		total += thread_data[msg_i * worker_threads + msg_i].backlog_dropped;
+	return total;
+}
+
+/*
+ * the paced dispatchers record how late they were in the message thread
+ * stats, see record_pacer_lag().  We only look at them after everyone has
+ * exited
+ */
+static void combine_pacer_stats(struct stats *stats,
+				struct thread_data *thread_data)
+{
+	int msg_i;
+
+	for (msg_i = 0; msg_i < message_threads; msg_i++)
+		combine_stats(stats, &thread_data[msg_i * worker_threads + msg_i].stats);
+}
+
+/* one line summary for the histograms that aren't the main event */
+static void show_lat_summary(char *label, struct stats *s)
+{
+	unsigned long long *ovals = NULL;
+	unsigned long *ocounts = NULL;
+	unsigned int len;
+
+	if (!s->nr_samples)
+		return;
+	len = calc_percentiles(s->plat, s->nr_samples, &ovals, &ocounts);
+	if (len > PLIST_P99)
+		fprintf(stdout, "%s (%s): p50 %llu p95 %llu p99 %llu max %llu (%lu samples)\n",
+			label, report_units, ovals[PLIST_P50] / report_div,
+			ovals[PLIST_P95] / report_div,
+			ovals[PLIST_P99] / report_div,
+			s->max / report_div, s->nr_samples);
+	free(ovals);
+	free(ocounts);
+}
+
+/*
+ * min and max don't survive subtract_stats(), so put them back at the
+ * edges of the lowest and highest buckets still in use
+ */
+static void stats_bucket_bounds(struct stats *s)
+{
+	unsigned int lo, hi, i;
+
+	stats_range(s, &lo, &hi);
+	s->min = 0;
+	s->max = 0;
+	for (i = lo; i < hi; i++) {
+		if (!s->plat[i])
+			continue;
+		if (!s->min)
+			s->min = plat_idx_to_val(i);
+		s->max = plat_idx_to_val(i);
+	}
+}
+
+/* one line for an interval or window, with the tail past p99 */
+static void show_window_summary(char *label, struct stats *s)
+{
+	unsigned long long *ovals = NULL;
+	unsigned long *ocounts = NULL;
+	unsigned int len;
+
+	if (!s->nr_samples)
+		return;
+	len = calc_percentiles(s->plat, s->nr_samples, &ovals, &ocounts);
+	if (len > PLIST_P999)
+		fprintf(stdout, "%s (%s): p50 %llu p99 %llu p99.9 %llu max %llu (%lu samples)\n",
+			label, report_units, ovals[PLIST_P50] / report_div,
+			ovals[PLIST_P99] / report_div,
+			ovals[PLIST_P999] / report_div,
+			s->max / report_div, s->nr_samples);
+	free(ovals);
+	free(ocounts);
+}
+
+/*
+ * --json and --csv records are built up in memory and written out together,
+ * so nothing else we print lands in the middle of one.  Records over
+ * PIPE_BUF can still reach a pipe reader in more than one read
+ */
+struct outbuf {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+static void out_printf(struct outbuf *ob, const char *fmt, ...)
+{
+	va_list ap;
+	int ret;
+
+	while (1) {
+		va_start(ap, fmt);
+		ret = vsnprintf(ob->buf + ob->len, ob->size - ob->len, fmt, ap);
+		va_end(ap);
+		if (ret < 0) {
+			perror("vsnprintf");
+			exit(1);
 		}
-	} else {
-		xlist_add(td->msg_thread, td);
+		if (ob->len + ret < ob->size)
+			break;
+		ob->size = (ob->size + ret + 1) * 2;
+		ob->buf = realloc(ob->buf, ob->size);
+		if (!ob->buf) {
+			perror("unable to allocate output buffer");
+			exit(1);
+		}
+	}
+	ob->len += ret;
+}
+
+static void out_flush(struct outbuf *ob, int fd)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < ob->len) {
+		ret = write(fd, ob->buf + done, ob->len - done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("write to output fd");
+			exit(1);
+		}
+		done += ret;
+	}
+	free(ob->buf);
+	memset(ob, 0, sizeof(*ob));
+}
+
+/*
+ * one histogram as a JSON object: counts, percentiles and non-zero buckets.
+ * Buckets are always in nsec, --units usec would fold neighbours together
+ */
+static void json_hist(struct outbuf *ob, char *name, struct stats *s)
+{
+	unsigned long long *ovals = NULL;
+	unsigned long *ocounts = NULL;
+	unsigned int len = 0, i;
+	char *sep = "";
+
+	if (s->nr_samples)
+		len = calc_percentiles(s->plat, s->nr_samples, &ovals, &ocounts);
+	out_printf(ob, "\"%s\":{\"samples\":%lu,\"min\":%llu,\"max\":%llu,\"percentiles\":{",
+		   name, s->nr_samples, s->min / report_div, s->max / report_div);
+	for (i = 0; i < len; i++)
+		out_printf(ob, "%s\"%.1f\":%llu", i ? "," : "", plist[i],
+			   ovals[i] / report_div);
+	out_printf(ob, "},\"buckets_ns\":[");
+	for (i = 0; i < PLAT_NR; i++) {
+		if (!s->plat[i])
+			continue;
+		out_printf(ob, "%s[%llu,%u]", sep, plat_idx_to_val(i), s->plat[i]);
+		sep = ",";
+	}
+	out_printf(ob, "]}");
+	free(ovals);
+	free(ocounts);
+}
+
+/* the same thing as rows of record,runtime,hist,field,key,value */
+static void csv_hist(struct outbuf *ob, char *record, unsigned long long runtime,
+		     char *name, struct stats *s)
+{
+	unsigned long long *ovals = NULL;
+	unsigned long *ocounts = NULL;
+	unsigned int len = 0, i;
+
+	if (s->nr_samples)
+		len = calc_percentiles(s->plat, s->nr_samples, &ovals, &ocounts);
+	out_printf(ob, "%s,%llu,%s,samples,,%lu\n", record, runtime, name, s->nr_samples);
+	out_printf(ob, "%s,%llu,%s,min,,%llu\n", record, runtime, name, s->min / report_div);
+	out_printf(ob, "%s,%llu,%s,max,,%llu\n", record, runtime, name, s->max / report_div);
+	for (i = 0; i < len; i++)
+		out_printf(ob, "%s,%llu,%s,percentile,%.1f,%llu\n", record, runtime,
+			   name, plist[i], ovals[i] / report_div);
+	for (i = 0; i < PLAT_NR; i++) {
+		if (s->plat[i])
+			out_printf(ob, "%s,%llu,%s,bucket_ns,%llu,%u\n", record, runtime,
+				   name, plat_idx_to_val(i), s->plat[i]);
 	}
+	free(ovals);
+	free(ocounts);
+}
+
+/*
+ * --schedstat.  We read /proc/schedstat (versions 15 through 17) at every
+ * interval and report the per-cpu and per-domain-level deltas along with
+ * that interval's latencies.  Domain counters are summed over the cpus at
+ * each level.  Times are in nsec
+ */
+#define SCHEDSTAT_MAX_DOMAINS 8
+
+enum {
+	LB_IDLE = 0,
+	LB_BUSY,
+	LB_NEWIDLE,
+	NR_LB_TYPES,
+};
+
+static char *lb_type_names[] = { "idle", "busy", "newidle" };
+
+struct schedstat_cpu {
+	int present;
+	unsigned long long sched_count;
+	unsigned long long sched_goidle;
+	unsigned long long ttwu_count;
+	unsigned long long ttwu_local;
+	unsigned long long run_ns;
+	unsigned long long wait_ns;
+	unsigned long long timeslices;
+};
+
+struct schedstat_domain {
+	unsigned long long lb_count[NR_LB_TYPES];
+	unsigned long long lb_failed[NR_LB_TYPES];
+	unsigned long long lb_gained[NR_LB_TYPES];
+	unsigned long long alb_pushed;
+	unsigned long long ttwu_wake_remote;
+	unsigned long long ttwu_move_affine;
+	unsigned long long ttwu_move_balance;
+};
+
+struct schedstat_sample {
+	unsigned long long time;
+	int nr_cpus;
+	int nr_domains;
+	struct schedstat_cpu cpus[CPU_SETSIZE];
+	struct schedstat_domain domains[SCHEDSTAT_MAX_DOMAINS];
+};
 
-	fpost(&td->msg_thread->futex);
+/* the last reset, the last interval, and scratch for reads and deltas */
+static struct schedstat_sample schedstat_base;
+static struct schedstat_sample schedstat_last;
+static struct schedstat_sample schedstat_now;
+static struct schedstat_sample schedstat_delta;
 
+static void parse_schedstat_domain(struct schedstat_domain *d, int version,
+				   char *line)
+{
+	unsigned long long vals[64];
+	/* v17 split lb_imbalance four ways */
+	int stride = version >= 17 ? 11 : 8;
+	int gained = version >= 17 ? 7 : 4;
 	/*
-	 * don't wait if the main threads are shutting down,
-	 * they will never kick us fpost has a full barrier, so as long
-	 * as the message thread walks his list after setting stopping,
-	 * we shouldn't miss the wakeup
+	 * which LB_* each group of columns is.  v16 reordered enum
+	 * cpu_idle_type, so busy comes first from there on
 	 */
-	if (!stopping) {
-		/* if he hasn't already woken us up, wait */
-		fwait(&td->futex, NULL);
+	static const int lb_v15[NR_LB_TYPES] = { LB_IDLE, LB_BUSY, LB_NEWIDLE };
+	static const int lb_v16[NR_LB_TYPES] = { LB_BUSY, LB_IDLE, LB_NEWIDLE };
+	const int *lb_order = version >= 16 ? lb_v16 : lb_v15;
+	char *save = NULL;
+	char *tok;
+	int skip;
+	int n = 0;
+	int i;
+
+	/* domainN, the cpumask, and from v17 on the domain name */
+	skip = version >= 17 ? 3 : 2;
+	for (tok = strtok_r(line, " \t\n", &save); tok;
+	     tok = strtok_r(NULL, " \t\n", &save)) {
+		if (skip) {
+			skip--;
+			continue;
+		}
+		if (n == 64)
+			break;
+		vals[n++] = strtoull(tok, NULL, 10);
+	}
+	/* three lb types, alb, sbe and sbf, then the three ttwu counters */
+	if (n < NR_LB_TYPES * stride + 12)
+		return;
+	for (i = 0; i < NR_LB_TYPES; i++) {
+		d->lb_count[lb_order[i]] += vals[i * stride];
+		d->lb_failed[lb_order[i]] += vals[i * stride + 2];
+		d->lb_gained[lb_order[i]] += vals[i * stride + gained];
+	}
+	d->alb_pushed += vals[NR_LB_TYPES * stride + 2];
+	d->ttwu_wake_remote += vals[n - 3];
+	d->ttwu_move_affine += vals[n - 2];
+	d->ttwu_move_balance += vals[n - 1];
+}
+
+/* returns -1 if there is no usable /proc/schedstat */
+static int read_schedstat(struct schedstat_sample *s)
+{
+	struct schedstat_cpu *c = NULL;
+	char *line = NULL;
+	size_t len = 0;
+	int version = 0;
+	int cpu;
+	int dom;
+	FILE *fp;
+
+	fp = fopen("/proc/schedstat", "r");
+	if (!fp)
+		return -1;
+	memset(s, 0, sizeof(*s));
+	s->time = nsec_now();
+	while (getline(&line, &len, fp) > 0) {
+		if (sscanf(line, "version %d", &version) == 1)
+			continue;
+		if (sscanf(line, "cpu%d", &cpu) == 1) {
+			c = NULL;
+			if (cpu < 0 || cpu >= CPU_SETSIZE)
+				continue;
+			c = s->cpus + cpu;
+			if (sscanf(line, "cpu%*d %*u %*u %llu %llu %llu %llu %llu %llu %llu",
+				   &c->sched_count, &c->sched_goidle,
+				   &c->ttwu_count, &c->ttwu_local,
+				   &c->run_ns, &c->wait_ns, &c->timeslices) != 7) {
+				c = NULL;
+				continue;
+			}
+			c->present = 1;
+			if (cpu >= s->nr_cpus)
+				s->nr_cpus = cpu + 1;
+		} else if (c && sscanf(line, "domain%d", &dom) == 1) {
+			if (dom < 0 || dom >= SCHEDSTAT_MAX_DOMAINS)
+				continue;
+			parse_schedstat_domain(s->domains + dom, version, line);
+			if (dom >= s->nr_domains)
+				s->nr_domains = dom + 1;
+		}
+	}
+	free(line);
+	fclose(fp);
+	if (version < 15 || version > 17) {
+		fprintf(stderr, "unsupported /proc/schedstat version %d\n", version);
+		return -1;
+	}
+	return 0;
+}
+
+#define SS_DELTA(field) d->field = n->field - o->field
+
+static void schedstat_sub(struct schedstat_sample *delta,
+			  struct schedstat_sample *new,
+			  struct schedstat_sample *old)
+{
+	int i, j;
+
+	memset(delta, 0, sizeof(*delta));
+	delta->time = new->time - old->time;
+	delta->nr_cpus = new->nr_cpus;
+	delta->nr_domains = new->nr_domains;
+	for (i = 0; i < new->nr_cpus; i++) {
+		struct schedstat_cpu *d = delta->cpus + i;
+		struct schedstat_cpu *n = new->cpus + i;
+		struct schedstat_cpu *o = old->cpus + i;
+
+		/* cpus that came online in between count from zero */
+		if (!n->present)
+			continue;
+		if (!o->present)
+			o = &(struct schedstat_cpu){ 0 };
+		d->present = 1;
+		SS_DELTA(sched_count);
+		SS_DELTA(sched_goidle);
+		SS_DELTA(ttwu_count);
+		SS_DELTA(ttwu_local);
+		SS_DELTA(run_ns);
+		SS_DELTA(wait_ns);
+		SS_DELTA(timeslices);
+	}
+	for (i = 0; i < new->nr_domains; i++) {
+		struct schedstat_domain *d = delta->domains + i;
+		struct schedstat_domain *n = new->domains + i;
+		struct schedstat_domain *o = old->domains + i;
+
+		for (j = 0; j < NR_LB_TYPES; j++) {
+			SS_DELTA(lb_count[j]);
+			SS_DELTA(lb_failed[j]);
+			SS_DELTA(lb_gained[j]);
+		}
+		SS_DELTA(alb_pushed);
+		SS_DELTA(ttwu_wake_remote);
+		SS_DELTA(ttwu_move_affine);
+		SS_DELTA(ttwu_move_balance);
+	}
+}
+
+/* move both baselines up, called when the latency stats get zeroed */
+static void schedstat_reset(void)
+{
+	if (!schedstat)
+		return;
+	if (read_schedstat(&schedstat_base)) {
+		fprintf(stderr, "unable to read /proc/schedstat, --schedstat is off\n");
+		schedstat = 0;
+		return;
+	}
+	schedstat_last = schedstat_base;
+}
+
+/*
+ * delta since the last interval (or since the last reset when
+ * since_reset is set).  Returns NULL if --schedstat is off
+ */
+static struct schedstat_sample *schedstat_sample(int since_reset)
+{
+	if (!schedstat || read_schedstat(&schedstat_now))
+		return NULL;
+	schedstat_sub(&schedstat_delta, &schedstat_now,
+		      since_reset ? &schedstat_base : &schedstat_last);
+	schedstat_last = schedstat_now;
+	return &schedstat_delta;
+}
+
+static void show_schedstat(struct schedstat_sample *s)
+{
+	unsigned long long run = 0, wait = 0, ttwu = 0, ttwu_local = 0;
+	unsigned long long gained[NR_LB_TYPES] = { 0 };
+	unsigned long long failed = 0;
+	int i, j;
+
+	for (i = 0; i < s->nr_cpus; i++) {
+		run += s->cpus[i].run_ns;
+		wait += s->cpus[i].wait_ns;
+		ttwu += s->cpus[i].ttwu_count;
+		ttwu_local += s->cpus[i].ttwu_local;
+	}
+	for (i = 0; i < s->nr_domains; i++) {
+		for (j = 0; j < NR_LB_TYPES; j++) {
+			gained[j] += s->domains[i].lb_gained[j];
+			failed += s->domains[i].lb_failed[j];
+		}
+	}
+	fprintf(stdout, "schedstat: run %llu ms wait %llu ms ttwu %llu (%llu local) "
+		"lb gained idle %llu busy %llu newidle %llu failed %llu\n",
+		run / NSEC_PER_MSEC, wait / NSEC_PER_MSEC, ttwu, ttwu_local,
+		gained[LB_IDLE], gained[LB_BUSY], gained[LB_NEWIDLE], failed);
+}
+
+static void json_schedstat(struct outbuf *ob, struct schedstat_sample *s)
+{
+	char *sep = "";
+	int i, j;
+
+	out_printf(ob, ",\"schedstat\":{\"elapsed_ns\":%llu,\"cpus\":[", s->time);
+	for (i = 0; i < s->nr_cpus; i++) {
+		struct schedstat_cpu *c = s->cpus + i;
+
+		if (!c->present)
+			continue;
+		out_printf(ob, "%s{\"cpu\":%d,\"run_ns\":%llu,\"wait_ns\":%llu,"
+			   "\"timeslices\":%llu,\"sched_count\":%llu,\"sched_goidle\":%llu,"
+			   "\"ttwu_count\":%llu,\"ttwu_local\":%llu}",
+			   sep, i, c->run_ns, c->wait_ns, c->timeslices,
+			   c->sched_count, c->sched_goidle, c->ttwu_count,
+			   c->ttwu_local);
+		sep = ",";
+	}
+	out_printf(ob, "],\"domains\":[");
+	for (i = 0; i < s->nr_domains; i++) {
+		struct schedstat_domain *d = s->domains + i;
+
+		out_printf(ob, "%s{\"level\":%d", i ? "," : "", i);
+		for (j = 0; j < NR_LB_TYPES; j++)
+			out_printf(ob, ",\"%s\":{\"lb_count\":%llu,\"lb_failed\":%llu,"
+				   "\"lb_gained\":%llu}", lb_type_names[j],
+				   d->lb_count[j], d->lb_failed[j], d->lb_gained[j]);
+		out_printf(ob, ",\"alb_pushed\":%llu,\"ttwu_wake_remote\":%llu,"
+			   "\"ttwu_move_affine\":%llu,\"ttwu_move_balance\":%llu}",
+			   d->alb_pushed, d->ttwu_wake_remote,
+			   d->ttwu_move_affine, d->ttwu_move_balance);
+	}
+	out_printf(ob, "]}");
+}
+
+/* hist is "schedstat", key is cpuN or domainN */
+static void csv_schedstat(struct outbuf *ob, char *record,
+			  unsigned long long runtime, struct schedstat_sample *s)
+{
+	char field[32];
+	int i, j;
+
+	for (i = 0; i < s->nr_cpus; i++) {
+		struct schedstat_cpu *c = s->cpus + i;
+
+		if (!c->present)
+			continue;
+		out_printf(ob, "%s,%llu,schedstat,run_ns,cpu%d,%llu\n", record, runtime, i, c->run_ns);
+		out_printf(ob, "%s,%llu,schedstat,wait_ns,cpu%d,%llu\n", record, runtime, i, c->wait_ns);
+		out_printf(ob, "%s,%llu,schedstat,timeslices,cpu%d,%llu\n", record, runtime, i, c->timeslices);
+		out_printf(ob, "%s,%llu,schedstat,ttwu_count,cpu%d,%llu\n", record, runtime, i, c->ttwu_count);
+		out_printf(ob, "%s,%llu,schedstat,ttwu_local,cpu%d,%llu\n", record, runtime, i, c->ttwu_local);
+	}
+	for (i = 0; i < s->nr_domains; i++) {
+		struct schedstat_domain *d = s->domains + i;
+
+		for (j = 0; j < NR_LB_TYPES; j++) {
+			snprintf(field, sizeof(field), "%s_lb_count", lb_type_names[j]);
+			out_printf(ob, "%s,%llu,schedstat,%s,domain%d,%llu\n", record, runtime, field, i, d->lb_count[j]);
+			snprintf(field, sizeof(field), "%s_lb_failed", lb_type_names[j]);
+			out_printf(ob, "%s,%llu,schedstat,%s,domain%d,%llu\n", record, runtime, field, i, d->lb_failed[j]);
+			snprintf(field, sizeof(field), "%s_lb_gained", lb_type_names[j]);
+			out_printf(ob, "%s,%llu,schedstat,%s,domain%d,%llu\n", record, runtime, field, i, d->lb_gained[j]);
+		}
+		out_printf(ob, "%s,%llu,schedstat,alb_pushed,domain%d,%llu\n", record, runtime, i, d->alb_pushed);
+		out_printf(ob, "%s,%llu,schedstat,ttwu_wake_remote,domain%d,%llu\n", record, runtime, i, d->ttwu_wake_remote);
+		out_printf(ob, "%s,%llu,schedstat,ttwu_move_affine,domain%d,%llu\n", record, runtime, i, d->ttwu_move_affine);
+		out_printf(ob, "%s,%llu,schedstat,ttwu_move_balance,domain%d,%llu\n", record, runtime, i, d->ttwu_move_balance);
+	}
+}
+
+/*
+ * --task-stats.  Every interval we read each worker's run delay,
+ * timeslices, migrations and involuntary switches, and put the per-worker
+ * deltas into these distributions.  run_delay_per_slice is the kernel's
+ * idea of the average wakeup latency, which is what we want to hold our
+ * own numbers up against
+ */
+enum {
+	TASK_RUN_DELAY = 0,
+	TASK_RUN_DELAY_PER_SLICE,
+	TASK_MIGRATIONS,
+	TASK_INVOLUNTARY,
+	NR_TASK_DISTS,
+};
+
+static char *task_dist_names[] = {
+	"run_delay", "run_delay_per_slice", "migrations", "involuntary_switches",
+};
+
+/* the first two are nsecs, the rest plain counts */
+#define TASK_DIST_IS_TIME(i) ((i) <= TASK_RUN_DELAY_PER_SLICE)
+
+static struct stats task_interval[NR_TASK_DISTS];
+static struct stats task_totals[NR_TASK_DISTS];
+
+/* the worker with the most migrations as of the last sample */
+static struct {
+	int msg_index;
+	int worker;
+	pid_t task_id;
+	unsigned long long migrations;
+} task_top;
+
+/* returns -1 if the thread is gone */
+static int read_task_sample(pid_t task_id, struct task_sample *s)
+{
+	char path[64];
+	char name[64];
+	unsigned long long val;
+	FILE *fp;
+
+	memset(s, 0, sizeof(*s));
+	snprintf(path, sizeof(path), "/proc/self/task/%d/schedstat", task_id);
+	fp = fopen(path, "r");
+	if (fp) {
+		if (fscanf(fp, "%llu %llu %llu", &s->run_ns, &s->wait_ns,
+			   &s->timeslices) != 3)
+			memset(s, 0, sizeof(*s));
+		fclose(fp);
+	}
+
+	/* the rest needs CONFIG_SCHED_DEBUG, and we live without it */
+	snprintf(path, sizeof(path), "/proc/self/task/%d/sched", task_id);
+	fp = fopen(path, "r");
+	if (!fp) {
+		snprintf(path, sizeof(path), "/proc/self/task/%d/status", task_id);
+		fp = fopen(path, "r");
+		if (!fp)
+			return -1;
+		while (fscanf(fp, "%63s", name) == 1) {
+			if (!strcmp(name, "nonvoluntary_ctxt_switches:") &&
+			    fscanf(fp, "%llu", &val) == 1)
+				s->involuntary = val;
+		}
+		fclose(fp);
+		return 0;
+	}
+	while (fscanf(fp, "%63s : %llu", name, &val) >= 1) {
+		if (!strcmp(name, "se.nr_migrations"))
+			s->migrations = val;
+		else if (!strcmp(name, "nr_involuntary_switches"))
+			s->involuntary = val;
+		/* skip whatever is left of the line */
+		if (fscanf(fp, "%*[^\n]") == EOF)
+			break;
 	}
-
-	return NULL;
+	fclose(fp);
+	return 0;
 }
 
 /*
- * read /proc/stat, return the percentage of non-idle time since
- * the last read.
+ * what sample_task_stats() does with the deltas.  The distributions hold
+ * one full -i window per sample, so the partial window at the end of the
+ * run only goes into the per-worker totals
  */
-float read_busy(int fd, char *buf, int len,
-		unsigned long long *total_time_ret,
-		unsigned long long *idle_time_ret)
+enum {
+	TASK_SAMPLE_BASE = 0,
+	TASK_SAMPLE_INTERVAL,
+	TASK_SAMPLE_FINAL,
+};
+
+/*
+ * read every worker, and unless we're just moving the baseline, record
+ * the deltas
+ */
+static void sample_task_stats(struct thread_data *thread_data, int record)
 {
-	unsigned long long total_time = 0;
-	unsigned long long idle_time = 0;
-	unsigned long long delta;
-	unsigned long long delta_idle;
-	unsigned long long val;
-	int col = 1;
-	int ret;
-	char *c;
-	char *save = NULL;
+	struct task_sample now;
+	struct task_sample *last;
+	int msg_i;
+	int i;
 
+	task_top.migrations = 0;
+	for (msg_i = 0; msg_i < message_threads; msg_i++) {
+		struct thread_data *worker = thread_data + msg_i * worker_threads + msg_i + 1;
 
-	ret = lseek(fd, 0, SEEK_SET);
-	if (ret < 0) {
-		perror("lseek");
-		exit(1);
-	}
-	ret = read(fd, buf, len-1);
-	if (ret < 0) {
-		perror("failed to read /proc/stat");
-		exit(1);
+		for (i = 0; i < worker_threads; i++, worker++) {
+			pid_t task_id = __atomic_load_n(&worker->task_id, __ATOMIC_ACQUIRE);
+			int valid = worker->task_valid;
+
+			worker->task_valid = 0;
+			if (!task_id || read_task_sample(task_id, &now))
+				continue;
+			worker->task_valid = 1;
+			last = &worker->task_last;
+			if (record && valid) {
+				unsigned long long slices = now.timeslices - last->timeslices;
+				unsigned long long vals[NR_TASK_DISTS];
+				int j;
+
+				vals[TASK_RUN_DELAY] = now.wait_ns - last->wait_ns;
+				vals[TASK_RUN_DELAY_PER_SLICE] = slices ?
+					vals[TASK_RUN_DELAY] / slices : 0;
+				vals[TASK_MIGRATIONS] = now.migrations - last->migrations;
+				vals[TASK_INVOLUNTARY] = now.involuntary - last->involuntary;
+				for (j = 0; record == TASK_SAMPLE_INTERVAL &&
+					    j < NR_TASK_DISTS; j++) {
+					add_lat(&task_interval[j], vals[j]);
+					add_lat(&task_totals[j], vals[j]);
+				}
+				worker->task_migrations += vals[TASK_MIGRATIONS];
+			}
+			*last = now;
+			if (worker->task_migrations > task_top.migrations) {
+				task_top.msg_index = msg_i;
+				task_top.worker = i;
+				task_top.task_id = task_id;
+				task_top.migrations = worker->task_migrations;
+			}
+		}
 	}
-	buf[ret] = '\0';
+}
 
-	/* find the newline */
-	c = strchr(buf, '\n');
-	if (c == NULL) {
-		perror("unable to parse /proc/stat");
-		exit(1);
+/* the stats were zeroed, start the totals over from here */
+static void task_stats_reset(struct thread_data *thread_data)
+{
+	int msg_i;
+	int i;
+
+	if (!task_stats)
+		return;
+	memset(task_totals, 0, sizeof(task_totals));
+	for (msg_i = 0; msg_i < message_threads; msg_i++) {
+		for (i = 0; i < worker_threads; i++)
+			thread_data[msg_i * worker_threads + msg_i + 1 + i].task_migrations = 0;
 	}
-	*c = '\0';
+	sample_task_stats(thread_data, TASK_SAMPLE_BASE);
+}
 
-	/* cpu  590315893 45841886 375984879 82585100131 166708940 0 5453892 0 0 0 */
-	c = strtok_r(buf, " ", &save);
-	if (strcmp(c, "cpu") != 0) {
-		perror("unable to parse summary in /proc/stat");
-		exit(1);
+static void show_task_stats(struct stats *dists)
+{
+	unsigned long long *ovals = NULL;
+	unsigned long *ocounts = NULL;
+	char label[64];
+	unsigned int len;
+	int i;
+
+	for (i = 0; i < NR_TASK_DISTS; i++) {
+		if (TASK_DIST_IS_TIME(i)) {
+			snprintf(label, sizeof(label), "task %s", task_dist_names[i]);
+			show_lat_summary(label, &dists[i]);
+			continue;
+		}
+		if (!dists[i].nr_samples)
+			continue;
+		len = calc_percentiles(dists[i].plat, dists[i].nr_samples, &ovals, &ocounts);
+		if (len > PLIST_P99)
+			fprintf(stdout, "task %s: p50 %llu p95 %llu p99 %llu max %llu (%lu samples)\n",
+				task_dist_names[i], ovals[PLIST_P50], ovals[PLIST_P95],
+				ovals[PLIST_P99], dists[i].max, dists[i].nr_samples);
+		free(ovals);
+		free(ocounts);
+		ovals = NULL;
+		ocounts = NULL;
 	}
+}
 
-	while (c != NULL) {
-		c = strtok_r(NULL, " ", &save);
-		if (!c)
-			break;
-		val = atoll(c);
-		if (col++ == 4)
-			idle_time = val;
-		total_time += val;
+/* percentiles only, raw nsecs or counts */
+static void json_task_stats(struct outbuf *ob, struct stats *dists)
+{
+	unsigned long long *ovals = NULL;
+	unsigned long *ocounts = NULL;
+	unsigned int len, j;
+	int i;
+
+	out_printf(ob, ",\"task\":{");
+	for (i = 0; i < NR_TASK_DISTS; i++) {
+		len = 0;
+		if (dists[i].nr_samples)
+			len = calc_percentiles(dists[i].plat, dists[i].nr_samples,
+					       &ovals, &ocounts);
+		out_printf(ob, "%s\"%s\":{\"samples\":%lu,\"max\":%llu,\"percentiles\":{",
+			   i ? "," : "", task_dist_names[i], dists[i].nr_samples,
+			   dists[i].max);
+		for (j = 0; j < len; j++)
+			out_printf(ob, "%s\"%.1f\":%llu", j ? "," : "", plist[j], ovals[j]);
+		out_printf(ob, "}}");
+		free(ovals);
+		free(ocounts);
+		ovals = NULL;
+		ocounts = NULL;
 	}
+	out_printf(ob, "}");
+}
 
-	if (*total_time_ret == 0) {
-		*total_time_ret = total_time;
-		*idle_time_ret = idle_time;
-		return 0.0;
+static void csv_task_stats(struct outbuf *ob, char *record,
+			   unsigned long long runtime, struct stats *dists)
+{
+	unsigned long long *ovals = NULL;
+	unsigned long *ocounts = NULL;
+	unsigned int len, j;
+	int i;
+
+	for (i = 0; i < NR_TASK_DISTS; i++) {
+		if (!dists[i].nr_samples)
+			continue;
+		len = calc_percentiles(dists[i].plat, dists[i].nr_samples, &ovals, &ocounts);
+		out_printf(ob, "%s,%llu,task,%s,samples,%lu\n", record, runtime,
+			   task_dist_names[i], dists[i].nr_samples);
+		out_printf(ob, "%s,%llu,task,%s,max,%llu\n", record, runtime,
+			   task_dist_names[i], dists[i].max);
+		for (j = 0; j < len; j++)
+			out_printf(ob, "%s,%llu,task,%s,%.1f,%llu\n", record, runtime,
+				   task_dist_names[i], plist[j], ovals[j]);
+		free(ovals);
+		free(ocounts);
+		ovals = NULL;
+		ocounts = NULL;
 	}
+}
 
-	/* delta is the total time spent doing everything */
-	delta = total_time - *total_time_ret;
-	delta_idle = idle_time - *idle_time_ret;
+/*
+ * --stall-detect samples, the per-cpu stall counters next to the steal time
+ * /proc/stat has for the same cpus.  These work like --schedstat, a
+ * baseline at every reset and deltas at every interval.
+ *
+ * Every interval also feeds each cpu's (stall ns, steal ns) pair into a
+ * running correlation, so the final report can say how much of what we saw
+ * the hypervisor owns up to
+ */
+struct stall_cpu {
+	int present;
+	unsigned long long count;
+	unsigned long long ns;
+	unsigned long long buckets[NR_STALL_BUCKETS];
+	unsigned long long steal_ns;
+};
 
-	*total_time_ret = total_time;
-	*idle_time_ret = idle_time;
+struct stall_sample {
+	unsigned long long time;
+	int nr_cpus;
+	struct stall_cpu cpus[CPU_SETSIZE];
+};
 
-	return 100.00 - ((float)delta_idle/(float)delta) * 100.00;
-}
+static struct stall_sample stall_base;
+static struct stall_sample stall_last;
+static struct stall_sample stall_now;
+static struct stall_sample stall_delta;
 
-#if defined(__x86_64__) || defined(__i386__)
-#define nop __asm__ __volatile__("rep;nop": : :"memory")
-#elif defined(__aarch64__)
-#define nop __asm__ __volatile__("yield" ::: "memory")
-#elif defined(__powerpc64__)
-#define nop __asm__ __volatile__("nop": : :"memory")
-#else
-#error Unsupported architecture
-#endif
+/* sums for the pearson correlation of stall and steal time */
+static struct {
+	unsigned long n;
+	double sx, sy, sxx, syy, sxy;
+} stall_corr;
 
-static void usec_spin(unsigned long spin_time)
+static void read_stalls(struct stall_sample *s)
 {
-	struct timeval now;
-	struct timeval start;
-	unsigned long long delta;
+	unsigned long long ticks;
+	long hz = sysconf(_SC_CLK_TCK);
+	char *line = NULL;
+	size_t len = 0;
+	int cpu;
+	int i, j;
+	FILE *fp;
+
+	memset(s, 0, sizeof(*s));
+	s->time = nsec_now();
+	for (i = 0; i < CPU_SETSIZE; i++) {
+		struct stall_counters *c = stall_live + i;
+
+		s->cpus[i].count = __atomic_load_n(&c->count, __ATOMIC_RELAXED);
+		if (!s->cpus[i].count)
+			continue;
+		s->cpus[i].ns = __atomic_load_n(&c->ns, __ATOMIC_RELAXED);
+		for (j = 0; j < NR_STALL_BUCKETS; j++)
+			s->cpus[i].buckets[j] = __atomic_load_n(&c->buckets[j],
+								__ATOMIC_RELAXED);
+		s->cpus[i].present = 1;
+		if (i >= s->nr_cpus)
+			s->nr_cpus = i + 1;
+	}
 
-	if (spin_time == 0)
+	/* cpuN user nice system idle iowait irq softirq steal, in USER_HZ */
+	fp = fopen("/proc/stat", "r");
+	if (!fp)
 		return;
-
-	if (jitter) {
-		unsigned int seed = pthread_self();
-		unsigned long new_time = rand_r(&seed) % spin_time;
-		spin_time = new_time + 1;
+	if (hz <= 0)
+		hz = 100;
+	while (getline(&line, &len, fp) > 0) {
+		if (sscanf(line, "cpu%d %*u %*u %*u %*u %*u %*u %*u %llu",
+			   &cpu, &ticks) != 2)
+			continue;
+		if (cpu < 0 || cpu >= CPU_SETSIZE)
+			continue;
+		s->cpus[cpu].steal_ns = ticks * (NSEC_PER_SEC / hz);
+		s->cpus[cpu].present = 1;
+		if (cpu >= s->nr_cpus)
+			s->nr_cpus = cpu + 1;
 	}
+	free(line);
+	fclose(fp);
+}
 
-	gettimeofday(&start, NULL);
-	while (1) {
-		gettimeofday(&now, NULL);
-		delta = tvdelta(&start, &now);
-		if (delta > spin_time)
-			return;
-		nop;
+static void stall_sub(struct stall_sample *delta, struct stall_sample *new,
+		      struct stall_sample *old)
+{
+	int i, j;
+
+	memset(delta, 0, sizeof(*delta));
+	delta->time = new->time - old->time;
+	delta->nr_cpus = new->nr_cpus;
+	for (i = 0; i < new->nr_cpus; i++) {
+		struct stall_cpu *d = delta->cpus + i;
+		struct stall_cpu *n = new->cpus + i;
+		struct stall_cpu *o = old->cpus + i;
+
+		if (!n->present)
+			continue;
+		d->present = 1;
+		d->count = n->count - o->count;
+		d->ns = n->ns - o->ns;
+		for (j = 0; j < NR_STALL_BUCKETS; j++)
+			d->buckets[j] = n->buckets[j] - o->buckets[j];
+		/* a cpu that just came online has no old steal */
+		d->steal_ns = n->steal_ns >= o->steal_ns ? n->steal_ns - o->steal_ns : 0;
 	}
 }
 
+static void stall_reset(void)
+{
+	if (!stall_thresh_ns)
+		return;
+	read_stalls(&stall_base);
+	stall_last = stall_base;
+	memset(&stall_corr, 0, sizeof(stall_corr));
+}
+
 /*
- * once the message thread starts all his children, this is where he
- * loops until our runtime is up.  Basically this sits around waiting
- * for posting by the worker threads, replying to their messages after
- * a delay of 'sleeptime' + some jitter.
+ * delta since the last interval (or since the last reset when
+ * since_reset is set).  Returns NULL if --stall-detect is off
  */
-static void run_msg_thread(struct thread_data *td)
+static struct stall_sample *stall_sample(int since_reset)
 {
-	unsigned int seed = pthread_self();
-	int max_jitter = sleeptime / 4;
-	int jitter = 0;
+	int i;
 
-	while (1) {
-		td->futex = FUTEX_BLOCKED;
-		xlist_wake_all(td);
+	if (!stall_thresh_ns)
+		return NULL;
+	read_stalls(&stall_now);
+	stall_sub(&stall_delta, &stall_now,
+		  since_reset ? &stall_base : &stall_last);
+	stall_last = stall_now;
+	if (since_reset)
+		return &stall_delta;
+
+	for (i = 0; i < stall_delta.nr_cpus; i++) {
+		struct stall_cpu *c = stall_delta.cpus + i;
+		double x = c->ns;
+		double y = c->steal_ns;
+
+		if (!c->present)
+			continue;
+		stall_corr.n++;
+		stall_corr.sx += x;
+		stall_corr.sy += y;
+		stall_corr.sxx += x * x;
+		stall_corr.syy += y * y;
+		stall_corr.sxy += x * y;
+	}
+	return &stall_delta;
+}
 
-		if (stopping) {
-			xlist_wake_all(td);
-			break;
-		}
-		if (sleeptime)
-			fwait(&td->futex, NULL);
+/* returns 0 and leaves r alone if either side never moved */
+static int stall_steal_correlation(double *r)
+{
+	double n = stall_corr.n;
+	double vx = n * stall_corr.sxx - stall_corr.sx * stall_corr.sx;
+	double vy = n * stall_corr.syy - stall_corr.sy * stall_corr.sy;
 
-		/*
-		 * messages shouldn't be instant, sleep a little to make them
-		 * wait
-		 */
-		usec_spin(message_cputime);
-		if (!pipe_test && sleeptime) {
-			jitter = rand_r(&seed) % max_jitter;
-			usleep(sleeptime + jitter);
-		}
+	if (stall_corr.n < 2 || vx <= 0 || vy <= 0)
+		return 0;
+	*r = (n * stall_corr.sxy - stall_corr.sx * stall_corr.sy) / sqrt(vx * vy);
+	return 1;
+}
+
+static void show_stalls(struct stall_sample *s)
+{
+	unsigned long long count = 0, ns = 0, steal = 0;
+	unsigned long long buckets[NR_STALL_BUCKETS] = { 0 };
+	int i, j;
+
+	for (i = 0; i < s->nr_cpus; i++) {
+		count += s->cpus[i].count;
+		ns += s->cpus[i].ns;
+		steal += s->cpus[i].steal_ns;
+		for (j = 0; j < NR_STALL_BUCKETS; j++)
+			buckets[j] += s->cpus[i].buckets[j];
+	}
+	fprintf(stdout, "stalls: %llu (%.2f ms)", count, (double)ns / NSEC_PER_MSEC);
+	for (j = 0; j < NR_STALL_BUCKETS; j++)
+		fprintf(stdout, " %s %llu", stall_bucket_names[j], buckets[j]);
+	fprintf(stdout, ", steal %.2f ms\n", (double)steal / NSEC_PER_MSEC);
+
+	for (i = 0; i < s->nr_cpus; i++) {
+		struct stall_cpu *c = s->cpus + i;
+
+		if (!c->count && !c->steal_ns)
+			continue;
+		fprintf(stdout, "\tcpu%d: stalls %llu (%.2f ms) steal %.2f ms\n",
+			i, c->count, (double)c->ns / NSEC_PER_MSEC,
+			(double)c->steal_ns / NSEC_PER_MSEC);
 	}
 }
 
-void auto_scale_rps(int *proc_stat_fd,
-		    unsigned long long *total_time,
-		    unsigned long long *total_idle)
+static void json_stalls(struct outbuf *ob, struct stall_sample *s)
 {
-	int fd = *proc_stat_fd;
-	float busy = 0;
-	char proc_stat_buf[512];
-	int first_run = 0;
-	float delta;
-	float target = 1;
-
-	if (fd == -1) {
-		fd = open("/proc/stat", O_RDONLY);
-		if (fd < 0) {
-			perror("unable to open /proc/stat");
-			exit(1);
-		}
-		*proc_stat_fd = fd;
-		first_run = 1;
+	char *sep = "";
+	int i, j;
+
+	out_printf(ob, ",\"stalls\":{\"elapsed_ns\":%llu,\"threshold_ns\":%llu,\"cpus\":[",
+		   s->time, stall_thresh_ns);
+	for (i = 0; i < s->nr_cpus; i++) {
+		struct stall_cpu *c = s->cpus + i;
+
+		if (!c->present)
+			continue;
+		out_printf(ob, "%s{\"cpu\":%d,\"count\":%llu,\"stall_ns\":%llu,"
+			   "\"steal_ns\":%llu,\"buckets\":{",
+			   sep, i, c->count, c->ns, c->steal_ns);
+		for (j = 0; j < NR_STALL_BUCKETS; j++)
+			out_printf(ob, "%s\"%s\":%llu", j ? "," : "",
+				   stall_bucket_names[j], c->buckets[j]);
+		out_printf(ob, "}}");
+		sep = ",";
 	}
-	busy = read_busy(fd, proc_stat_buf, 512, total_time, total_idle);
-	if (first_run)
-		return;
+	out_printf(ob, "]}");
+}
 
-	if (busy < auto_rps) {
-		delta = (float)auto_rps / busy;
-		/* delta is > 1 */
-		if (delta > 3) {
-			delta = 3;
-		} else if (delta < 1.2) {
-			delta = 1 + (delta - 1) / 8;
-		} else if (delta < 1.5) {
-			delta = 1 + (delta - 1) / 4;
-		}
-		target = ceilf((float)requests_per_sec * delta);
-		if (target >= (1ULL << 31)) {
-			/*
-			 * sometimes we don't have enough threads to hit the
-			 * target load
-			 */
-			target = requests_per_sec;
-		}
-	} else if (busy > auto_rps) {
-		/* delta < 1 */
-		delta = (float)auto_rps / busy;
-		if (delta < 0.3) {
-			delta = 0.3;
-		} else if (delta > .9) {
-			delta += (1 - delta) / 8;
-		} else if (delta > .8) {
-			delta += (1 - delta) / 4;
-		}
-		target = floorf((float)requests_per_sec * delta);
-		if (target <= 0)
-			target = 0;
-	} else {
-		target = requests_per_sec;
+/* hist is "stalls", key is cpuN */
+static void csv_stalls(struct outbuf *ob, char *record,
+		       unsigned long long runtime, struct stall_sample *s)
+{
+	char field[32];
+	int i, j;
+
+	for (i = 0; i < s->nr_cpus; i++) {
+		struct stall_cpu *c = s->cpus + i;
+
+		if (!c->present)
+			continue;
+		out_printf(ob, "%s,%llu,stalls,count,cpu%d,%llu\n", record, runtime, i, c->count);
+		out_printf(ob, "%s,%llu,stalls,stall_ns,cpu%d,%llu\n", record, runtime, i, c->ns);
+		out_printf(ob, "%s,%llu,stalls,steal_ns,cpu%d,%llu\n", record, runtime, i, c->steal_ns);
+		for (j = 0; j < NR_STALL_BUCKETS; j++) {
+			snprintf(field, sizeof(field), "count%s", stall_bucket_names[j]);
+			out_printf(ob, "%s,%llu,stalls,%s,cpu%d,%llu\n", record, runtime,
+				   field, i, c->buckets[j]);
+		}
 	}
-	requests_per_sec = target;
 }
 
 /*
- * once the message thread starts all his children, this is where he
- * loops until our runtime is up.  Basically this sits around waiting
- * for posting by the worker threads, replying to their messages after
- * a delay of 'sleeptime' + some jitter.
+ * write one --json or --csv record.  total is everything since the stats
+ * were zeroed.  extra is indexed by LAT_* and may be NULL, the empty
+ * histograms in it are skipped.  Interval records also carry the samples
+ * from just this interval, and from the --window when there is one.
+ * pacer is only set for the final record, sched only with --schedstat,
+ * task only with --task-stats and stall only with --stall-detect
  */
-static void run_rps_thread(struct thread_data *worker_threads_mem)
+static void emit_record(char *record, unsigned long long runtime, double rps,
+			struct stats *total, struct stats *extra,
+			struct stats *interval, struct stats *window,
+			struct stats *pacer, unsigned long dropped,
+			unsigned long backlog_dropped, unsigned long steals,
+			struct schedstat_sample *sched, struct stats *task,
+			struct stall_sample *stall)
 {
-	/* number to wake at a time */
-	int nr_to_wake = worker_threads * 2 / 3;
-	/* how many times we tried to wake up workers */
-	unsigned long total_wake_runs = 0;
-	/* list to record tasks waiting for work */
-	/* how many times do we need to batch wakeups per second */
-	int wakeups_required;
-	/* start and end of the thread run */
-	struct timeval start;
-	struct request *request;
-
-	/* how long do we sleep between wakeup batches */
-	unsigned long sleep_time;
-	/* total number of times we kicked a worker */
-	unsigned long total_wakes = 0;
-	int cur_tid = 0;
+	static int csv_header;
+	struct outbuf ob = { NULL, 0, 0 };
 	int i;
 
-	gettimeofday(&start, NULL);
-
-	while (1) {
-		wakeups_required = (requests_per_sec + nr_to_wake - 1) / nr_to_wake;
-		sleep_time = USEC_PER_SEC / wakeups_required;
-
-		/* start with a sleep to give everyone the chance to get going */
-		usleep(sleep_time);
-
-		gettimeofday(&start, NULL);
-
-		for (i = 0; i < nr_to_wake; i++) {
-			struct thread_data *worker;
-
-			worker = worker_threads_mem + cur_tid % worker_threads;
-			cur_tid++;
-
-			/* at some point, there's just too much, don't queue more */
-			if (worker->pending > 8) {
+	if (output_format == OUTPUT_JSON) {
+		out_printf(&ob, "{\"record\":\"%s\",\"runtime\":%llu,\"units\":\"%s\",\"rps\":%.2f",
+			   record, runtime, report_units, rps);
+		/* dropped requests never got a latency, so we can't vouch for these */
+		if (pacer)
+			out_printf(&ob, ",\"dropped\":%lu,\"backlog_dropped\":%lu,"
+				   "\"steals\":%lu,\"valid\":%s",
+				   dropped, backlog_dropped, steals,
+				   dropped || backlog_dropped ? "false" : "true");
+		out_printf(&ob, ",\"latency\":{");
+		json_hist(&ob, lat_stats_names[LAT_TOTAL], total);
+		for (i = LAT_TOTAL + 1; extra && i < NR_LAT_STATS; i++) {
+			if (!extra[i].nr_samples)
 				continue;
-			}
-			worker->pending++;
-			request = allocate_request();
-			request_add(worker, request);
-			total_wakes++;
-			memcpy(&worker->wake_time, &start, sizeof(start));
-			fpost(&worker->futex);
+			out_printf(&ob, ",");
+			json_hist(&ob, lat_stats_names[i], &extra[i]);
 		}
-		total_wake_runs++;
-
-		if (stopping) {
-			for (i = 0; i < worker_threads; i++)
-				fpost(&worker_threads_mem[i].futex);
-			break;
+		if (pacer && pacer->nr_samples) {
+			out_printf(&ob, ",");
+			json_hist(&ob, "pacer", pacer);
 		}
-
+		out_printf(&ob, "}");
+		if (interval) {
+			out_printf(&ob, ",\"interval\":{");
+			json_hist(&ob, lat_stats_names[LAT_TOTAL], interval);
+			out_printf(&ob, "}");
+		}
+		if (window) {
+			out_printf(&ob, ",\"window\":{\"intervals\":%d,", window_filled);
+			json_hist(&ob, lat_stats_names[LAT_TOTAL], window);
+			out_printf(&ob, "}");
+		}
+		if (sched)
+			json_schedstat(&ob, sched);
+		if (task)
+			json_task_stats(&ob, task);
+		if (stall)
+			json_stalls(&ob, stall);
+		out_printf(&ob, "}\n");
+	} else {
+		if (!csv_header) {
+			out_printf(&ob, "record,runtime,hist,field,key,value\n");
+			csv_header = 1;
+		}
+		out_printf(&ob, "%s,%llu,,rps,,%.2f\n", record, runtime, rps);
+		out_printf(&ob, "%s,%llu,,units,,%s\n", record, runtime, report_units);
+		if (pacer) {
+			out_printf(&ob, "%s,%llu,,dropped,,%lu\n", record, runtime, dropped);
+			out_printf(&ob, "%s,%llu,,backlog_dropped,,%lu\n", record, runtime,
+				   backlog_dropped);
+			out_printf(&ob, "%s,%llu,,steals,,%lu\n", record, runtime, steals);
+			out_printf(&ob, "%s,%llu,,valid,,%d\n", record, runtime,
+				   !dropped && !backlog_dropped);
+		}
+		csv_hist(&ob, record, runtime, lat_stats_names[LAT_TOTAL], total);
+		for (i = LAT_TOTAL + 1; extra && i < NR_LAT_STATS; i++) {
+			if (extra[i].nr_samples)
+				csv_hist(&ob, record, runtime, lat_stats_names[i], &extra[i]);
+		}
+		if (pacer && pacer->nr_samples)
+			csv_hist(&ob, record, runtime, "pacer", pacer);
+		if (interval)
+			csv_hist(&ob, record, runtime, "interval", interval);
+		if (window)
+			csv_hist(&ob, record, runtime, "window", window);
+		if (sched)
+			csv_schedstat(&ob, record, runtime, sched);
+		if (task)
+			csv_task_stats(&ob, record, runtime, task);
+		if (stall)
+			csv_stalls(&ob, record, runtime, stall);
 	}
-	fprintf(stderr, "final rps was %llu\n", requests_per_sec);
+	out_flush(&ob, output_fd);
 }
 
 /*
- * multiply two matrices in a naive way to emulate some cache footprint
+ * --hist-log files start with a hist_log_header, followed by one
+ * hist_log_record per histogram per report.  Each record is followed by
+ * nr_buckets hist_log_bucket entries, only the non-zero plat[] slots are
+ * written.  Everything is in host byte order and nsecs
  */
-static void do_some_math(struct thread_data *thread_data)
-{
-	unsigned long i, j, k;
-	unsigned long *m1, *m2, *m3;
+#define HIST_LOG_MAGIC "SCHBHIST"
+#define HIST_LOG_VERSION 1
+#define HIST_LOG_NAME_LEN 16
 
-	m1 = &thread_data->data[0];
-	m2 = &thread_data->data[matrix_size * matrix_size];
-	m3 = &thread_data->data[2 * matrix_size * matrix_size];
+enum {
+	HIST_RECORD_INTERVAL = 0,
+	HIST_RECORD_FINAL,
+};
 
-	for (i = 0; i < matrix_size; i++) {
-		for (j = 0; j < matrix_size; j++) {
-			m3[i * matrix_size + j] = 0;
+struct hist_log_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t plat_bits;
+	uint32_t plat_group_nr;
+	uint32_t pad;
+};
 
-			for (k = 0; k < matrix_size; k++)
-				m3[i * matrix_size + j] +=
-					m1[i * matrix_size + k] *
-					m2[k * matrix_size + j];
+struct hist_log_record {
+	uint32_t record;
+	uint32_t nr_buckets;
+	char name[HIST_LOG_NAME_LEN];
+	uint64_t runtime;
+	/* requests per second * 100 */
+	uint64_t rps;
+	uint64_t nr_samples;
+	uint64_t min;
+	uint64_t max;
+};
+
+struct hist_log_bucket {
+	uint32_t idx;
+	uint32_t count;
+};
+
+static void out_append(struct outbuf *ob, void *data, size_t len)
+{
+	if (ob->len + len > ob->size) {
+		ob->size = (ob->len + len) * 2;
+		ob->buf = realloc(ob->buf, ob->size);
+		if (!ob->buf) {
+			perror("unable to allocate output buffer");
+			exit(1);
 		}
 	}
+	memcpy(ob->buf + ob->len, data, len);
+	ob->len += len;
 }
 
-/*
- * spin or do some matrix arithmetic
- */
-static void do_work(struct thread_data *td)
+static void open_hist_log(void)
 {
-	if (matrix_size) {
-		unsigned long i;
+	struct hist_log_header hdr;
+	ssize_t ret;
 
-		for (i = 0; i < operations; i++)
-			do_some_math(td);
-	} else {
-		usec_spin(cputime);
+	hist_log_fd = open(hist_log_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (hist_log_fd < 0) {
+		perror("unable to open histogram log");
+		exit(1);
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, HIST_LOG_MAGIC, sizeof(hdr.magic));
+	hdr.version = HIST_LOG_VERSION;
+	hdr.plat_bits = PLAT_BITS;
+	hdr.plat_group_nr = PLAT_GROUP_NR;
+	ret = write(hist_log_fd, &hdr, sizeof(hdr));
+	if (ret != sizeof(hdr)) {
+		perror("unable to write histogram log");
+		exit(1);
+	}
+}
+
+static void hist_log_one(struct outbuf *ob, int record, char *name,
+			 unsigned long long runtime, double rps, struct stats *s)
+{
+	struct hist_log_record rec;
+	struct hist_log_bucket bucket;
+	unsigned int i;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.record = record;
+	for (i = 0; i < PLAT_NR; i++)
+		if (s->plat[i])
+			rec.nr_buckets++;
+	strncpy(rec.name, name, HIST_LOG_NAME_LEN - 1);
+	rec.runtime = runtime;
+	rec.rps = rps * 100;
+	rec.nr_samples = s->nr_samples;
+	rec.min = s->min;
+	rec.max = s->max;
+	out_append(ob, &rec, sizeof(rec));
+	for (i = 0; i < PLAT_NR; i++) {
+		if (!s->plat[i])
+			continue;
+		bucket.idx = i;
+		bucket.count = s->plat[i];
+		out_append(ob, &bucket, sizeof(bucket));
 	}
 }
 
 /*
- * the worker thread is pretty simple, it just does a single spin and
- * then waits on a message from the message thread
+ * append one report to the --hist-log, same arguments as emit_record().
+ * Only the total histogram goes in when it's empty, so a merge can still
+ * count the report
  */
-void *worker_thread(void *arg)
+static void hist_log_report(int record, unsigned long long runtime, double rps,
+			    struct stats *total, struct stats *extra,
+			    struct stats *pacer)
 {
-	struct thread_data *td = arg;
-	struct timeval now;
-	struct timeval start;
-	unsigned long long delta;
-	struct request *req = NULL;
-
-	gettimeofday(&start, NULL);
-	while(1) {
-		if (stopping)
-			break;
+	struct outbuf ob = { NULL, 0, 0 };
+	int i;
 
-		req = msg_and_wait(td);
-		if (requests_per_sec) {
-			while (req) {
-				struct request *tmp = req->next;
+	hist_log_one(&ob, record, lat_stats_names[LAT_TOTAL], runtime, rps, total);
+	for (i = LAT_TOTAL + 1; extra && i < NR_LAT_STATS; i++) {
+		if (extra[i].nr_samples)
+			hist_log_one(&ob, record, lat_stats_names[i], runtime, rps,
+				     &extra[i]);
+	}
+	if (pacer && pacer->nr_samples)
+		hist_log_one(&ob, record, "pacer", runtime, rps, pacer);
 
-				do_work(td);
+	out_flush(&ob, hist_log_fd);
+}
 
-				gettimeofday(&now, NULL);
-				delta = tvdelta(&req->start_time, &now);
-				td->runtime = tvdelta(&start, &now);
-				add_lat(&td->stats, delta);
+/* the histograms a merge keeps track of, LAT_* and then the pacer */
+#define HIST_PACER NR_LAT_STATS
+#define NR_HIST_NAMES (NR_LAT_STATS + 1)
 
-				free(req);
-				req = tmp;
-				td->loop_count++;
-			}
-		} else {
-			do_work(td);
-			td->loop_count++;
-			gettimeofday(&now, NULL);
-			td->runtime = tvdelta(&start, &now);
-		}
+struct hist_set {
+	struct stats stats[NR_HIST_NAMES];
+	unsigned long long runtime;
+	double rps;
+	int nr_logs;
+};
 
-		if (!requests_per_sec) {
-			gettimeofday(&now, NULL);
-			delta = tvdelta(&td->wake_time, &now);
-			if (delta > 0)
-				add_lat(&td->stats, delta);
-		}
-	}
-	gettimeofday(&now, NULL);
-	td->runtime = tvdelta(&start, &now);
+static int hist_name_index(char *name)
+{
+	int i;
 
-	return NULL;
+	for (i = 0; i < NR_LAT_STATS; i++)
+		if (!strcmp(name, lat_stats_names[i]))
+			return i;
+	if (!strcmp(name, "pacer"))
+		return HIST_PACER;
+	return -1;
+}
+
+static char *hist_name(int i)
+{
+	return i == HIST_PACER ? "pacer" : lat_stats_names[i];
 }
 
 /*
- * the message thread starts his own gaggle of workers and then sits around
- * replying when they post him.  He collects latency stats as all the threads
- * exit
+ * read one log and fold its final histograms into set.  Runs add up their
+ * throughput, the longest runtime wins
  */
-void *message_thread(void *arg)
+static void read_hist_log(char *path, struct hist_set *set)
 {
-	struct thread_data *td = arg;
-	struct thread_data *worker_threads_mem = NULL;
-	int i;
-	int ret;
-
-	worker_threads_mem = td + 1;
-
-	if (!worker_threads_mem) {
-		perror("unable to allocate ram");
-		pthread_exit((void *)-ENOMEM);
+	struct hist_log_header hdr;
+	struct hist_log_record rec;
+	struct hist_log_bucket bucket;
+	struct stats *s = malloc(sizeof(*s));
+	unsigned long long runtime = 0;
+	double rps = 0;
+	unsigned int i;
+	int found = 0;
+	int which;
+	FILE *fp;
+
+	if (!s) {
+		perror("malloc");
+		exit(1);
+	}
+	fp = fopen(path, "r");
+	if (!fp) {
+		fprintf(stderr, "unable to open %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    memcmp(hdr.magic, HIST_LOG_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.version != HIST_LOG_VERSION) {
+		fprintf(stderr, "%s is not a schbench histogram log\n", path);
+		exit(1);
+	}
+	if (hdr.plat_bits != PLAT_BITS || hdr.plat_group_nr != PLAT_GROUP_NR) {
+		fprintf(stderr, "%s has %u/%u histogram buckets, we use %u/%u\n",
+			path, hdr.plat_bits, hdr.plat_group_nr, PLAT_BITS,
+			PLAT_GROUP_NR);
+		exit(1);
 	}
 
-	for (i = 0; i < worker_threads; i++) {
-		pthread_t tid;
-
-		if (matrix_size) {
-			worker_threads_mem[i].data = malloc(3 * sizeof(unsigned long) * matrix_size * matrix_size);
-			if (!worker_threads_mem[i].data) {
-				perror("unable to allocate ram");
-				pthread_exit((void *)-ENOMEM);
+	while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+		rec.name[HIST_LOG_NAME_LEN - 1] = '\0';
+		memset(s, 0, sizeof(*s));
+		s->nr_samples = rec.nr_samples;
+		s->min = rec.min;
+		s->max = rec.max;
+		for (i = 0; i < rec.nr_buckets; i++) {
+			if (fread(&bucket, sizeof(bucket), 1, fp) != 1 ||
+			    bucket.idx >= PLAT_NR) {
+				fprintf(stderr, "%s is truncated or corrupt\n", path);
+				exit(1);
 			}
+			s->plat[bucket.idx] = bucket.count;
+			stats_mark(s, bucket.idx);
 		}
-
-		worker_threads_mem[i].msg_thread = td;
-		ret = pthread_create(&tid, NULL, worker_thread,
-				     worker_threads_mem + i);
-		if (ret) {
-			fprintf(stderr, "error %d from pthread_create\n", ret);
-			exit(1);
+		if (rec.record != HIST_RECORD_FINAL)
+			continue;
+		which = hist_name_index(rec.name);
+		if (which < 0) {
+			fprintf(stderr, "%s: skipping unknown histogram '%s'\n",
+				path, rec.name);
+			continue;
 		}
-		worker_threads_mem[i].tid = tid;
+		combine_stats(&set->stats[which], s);
+		runtime = rec.runtime;
+		rps = (double)rec.rps / 100;
+		found = 1;
 	}
+	fclose(fp);
+	free(s);
 
-	if (requests_per_sec)
-		run_rps_thread(worker_threads_mem);
-	else
-		run_msg_thread(td);
-
-	for (i = 0; i < worker_threads; i++) {
-		fpost(&worker_threads_mem[i].futex);
-		pthread_join(worker_threads_mem[i].tid, NULL);
+	if (!found) {
+		fprintf(stderr, "%s has no final histograms, skipping it\n", path);
+		return;
 	}
-	return NULL;
+	if (runtime > set->runtime)
+		set->runtime = runtime;
+	set->rps += rps;
+	set->nr_logs++;
 }
 
-static char *units[] = { "B", "KB", "MB", "GB", "TB", "PB", "EB", NULL};
+/* print the percentiles of two histograms side by side */
+static void show_hist_diff(char *name, struct stats *base, struct stats *s)
+{
+	unsigned long long *bvals = NULL, *ovals = NULL;
+	unsigned long *bcounts = NULL, *ocounts = NULL;
+	unsigned int blen, len, i;
+	long long delta;
 
-static double pretty_size(double number, char **str)
+	blen = calc_percentiles(base->plat, base->nr_samples, &bvals, &bcounts);
+	len = calc_percentiles(s->plat, s->nr_samples, &ovals, &ocounts);
+	if (blen != len)
+		len = 0;
+
+	fprintf(stderr, "%s (%s): %lu base samples, %lu samples\n", name,
+		report_units, base->nr_samples, s->nr_samples);
+	for (i = 0; i < len; i++) {
+		delta = (long long)ovals[i] - (long long)bvals[i];
+		fprintf(stderr, "\t%s%2.1fth: %-10llu -> %-10llu %+lld (%+.2f%%)\n",
+			i == PLIST_P99 ? "* " : "  ", plist[i],
+			bvals[i] / report_div, ovals[i] / report_div,
+			delta / (long long)report_div,
+			bvals[i] ? (double)delta * 100 / bvals[i] : 0);
+	}
+	fprintf(stderr, "\t  max=%llu -> %llu\n", base->max / report_div,
+		s->max / report_div);
+
+	free(bvals);
+	free(bcounts);
+	free(ovals);
+	free(ocounts);
+}
+
+/*
+ * --hist-merge and --hist-diff.  Merging uses the same combine_stats()
+ * the live runs use, so the percentiles are the ones you'd get from one
+ * big run across all the hosts
+ */
+static int run_hist_tool(void)
 {
-	int divs = 0;
+	struct hist_set *set = calloc(1, sizeof(*set));
+	struct hist_set *base = NULL;
+	char *p, *path;
+	int i;
 
-	while(number >= 1024) {
-		if (units[divs + 1] == NULL)
-			break;
-		divs++;
-		number /= 1024;
+	if (!set) {
+		perror("calloc");
+		exit(1);
 	}
-	*str = units[divs];
-	return number;
+	for (i = 0; i < nr_hist_files; i++)
+		read_hist_log(hist_files[i], set);
+	if (!set->nr_logs) {
+		fprintf(stderr, "no usable histogram logs\n");
+		return 1;
+	}
+
+	if (hist_tool == HIST_TOOL_MERGE) {
+		fprintf(stderr, "merged %d logs\n", set->nr_logs);
+		show_latencies(&set->stats[LAT_TOTAL], breakdown ? set->stats : NULL,
+			       set->runtime);
+		fprintf(stdout, "rps: %.2f\n", set->rps);
+		for (i = LAT_TOTAL + 1; i < NR_HIST_NAMES; i++)
+			show_lat_summary(hist_name(i), &set->stats[i]);
+		if (output_format)
+			emit_record("merged", set->runtime, set->rps,
+				    &set->stats[LAT_TOTAL], set->stats,
+				    NULL, NULL, &set->stats[HIST_PACER], 0, 0, 0,
+				    NULL, NULL, NULL);
+		free(set);
+		return 0;
+	}
+
+	base = calloc(1, sizeof(*base));
+	if (!base) {
+		perror("calloc");
+		exit(1);
+	}
+	path = strtok_r(hist_diff_base, ",", &p);
+	while (path) {
+		read_hist_log(path, base);
+		path = strtok_r(NULL, ",", &p);
+	}
+	if (!base->nr_logs) {
+		fprintf(stderr, "no usable baseline histogram logs\n");
+		return 1;
+	}
+
+	fprintf(stderr, "comparing %d baseline logs against %d logs\n",
+		base->nr_logs, set->nr_logs);
+	fprintf(stderr, "rps: %.2f -> %.2f (%+.2f%%)\n", base->rps, set->rps,
+		base->rps ? (set->rps - base->rps) * 100 / base->rps : 0);
+	for (i = 0; i < NR_HIST_NAMES; i++) {
+		if (base->stats[i].nr_samples && set->stats[i].nr_samples)
+			show_hist_diff(hist_name(i), &base->stats[i], &set->stats[i]);
+	}
+	free(base);
+	free(set);
+	return 0;
 }
 
+/* collect the latencies recorded by all the workers since the last reset */
 static void combine_message_thread_stats(struct stats *stats,
 					struct thread_data *thread_data,
 					unsigned long long *loop_count,
@@ -1182,110 +7307,531 @@ static void combine_message_thread_stats(struct stats *stats,
 	int msg_i;
 	int index = 0;
 
+	combine_lat_stats(stats, thread_data, LAT_TOTAL);
+
 	*loop_count = 0;
 	*loop_runtime = 0;
 	for (msg_i = 0; msg_i < message_threads; msg_i++) {
 		index++;
 		for (i = 0; i < worker_threads; i++) {
 			worker = thread_data + index++;
-			combine_stats(stats, &worker->stats);
 			*loop_count += worker->loop_count;
 			*loop_runtime += worker->runtime;
 		}
 	}
 }
 
+/*
+ * zero the stats without touching the workers.  We move the baseline up to
+ * the current totals and bump the epoch so min/max start over
+ */
 static void reset_thread_stats(struct thread_data *thread_data)
 {
-	struct thread_data *worker;
 	int i;
-	int msg_i;
-	int index = 0;
 
-	for (msg_i = 0; msg_i < message_threads; msg_i++) {
-		index++;
-		for (i = 0; i < worker_threads; i++) {
-			worker = thread_data + index++;
-			memset(&worker->stats, 0, sizeof(worker->stats));
-		}
+	__atomic_add_fetch(&stats_epoch, 1, __ATOMIC_RELEASE);
+	memset(base_stats, 0, sizeof(base_stats));
+	for (i = 0; i < NR_LAT_STATS; i++)
+		snapshot_message_thread_stats(&base_stats[i], thread_data, i);
+	for (i = 0; i < nr_groups; i++) {
+		memset(groups[i].base, 0, sizeof(struct stats));
+		snapshot_group_stats(groups[i].base, thread_data, LAT_TOTAL,
+				     groups + i);
 	}
+	schedstat_reset();
+	task_stats_reset(thread_data);
+	stall_reset();
+}
+
+/*
+ * the reporting thread has to stay out of the way of what it measures.
+ * We keep track of its cpu time for the whole run, and separately for
+ * the histogram merges at each interval
+ */
+static unsigned long long reporter_cpu;
+static unsigned long long reporter_merge_cpu;
+static unsigned long reporter_merges;
+static unsigned long long reporter_wall;
+
+static void show_reporter_cpu(void)
+{
+	if (!reporter_wall)
+		return;
+	fprintf(stdout, "reporter cpu: %.2f ms (%.3f%% of a cpu)",
+		(double)reporter_cpu / NSEC_PER_MSEC,
+		(double)reporter_cpu * 100 / reporter_wall);
+	if (reporter_merges)
+		fprintf(stdout, ", %.1f usec per interval merge of %d threads",
+			(double)reporter_merge_cpu / reporter_merges / NSEC_PER_USEC,
+			message_threads * worker_threads);
+	fprintf(stdout, "\n");
 }
 
 /* runtime from the command line is in seconds.  Sleep until its up */
 static void sleep_for_runtime(struct thread_data *message_threads_mem)
 {
-	struct timeval now;
-	struct timeval zero_time;
-	struct timeval last_calc;
-	struct timeval start;
+	unsigned long long now;
+	unsigned long long zero_time;
+	unsigned long long last_calc;
+	unsigned long long start;
 	struct stats stats;
+	static struct stats extra[NR_LAT_STATS];
 	unsigned long long loop_count;
 	unsigned long long loop_runtime;
 	unsigned long long delta;
 	unsigned long long runtime_delta;
-	unsigned long long runtime_usec = runtime * USEC_PER_SEC;
-	unsigned long long warmup_usec = warmuptime * USEC_PER_SEC;
-	unsigned long long interval_usec = intervaltime * USEC_PER_SEC;
-	unsigned long long zero_usec = zerotime * USEC_PER_SEC;
+	unsigned long long runtime_nsec = runtime * NSEC_PER_SEC;
+	unsigned long long warmup_nsec = warmuptime * NSEC_PER_SEC;
+	unsigned long long interval_nsec = intervaltime * NSEC_PER_SEC;
+	unsigned long long zero_nsec = zerotime * NSEC_PER_SEC;
+	struct schedstat_sample *sched;
+	struct stall_sample *stall;
+	/*
+	 * the totals at the last interval, so we can report each interval
+	 * without zeroing anything, and a ring of the last --window intervals
+	 */
+	static struct stats last_total;
+	static struct stats interval_stats;
+	static struct stats window_stats;
+	struct stats *window_ring = NULL;
+	int window_pos = 0;
 	int warmup_done = 0;
+	unsigned long long cpu_start = thread_cpu_ns();
+	unsigned long long merge_start;
+	int i;
 
-	/* if we're autoscaling RPS */
-	int proc_stat_fd = -1;
-	unsigned long long total_time = 0;
-	unsigned long long total_idle = 0;
+	memset(&last_total, 0, sizeof(last_total));
+	if (window_intervals) {
+		window_ring = calloc(window_intervals, sizeof(struct stats));
+		if (!window_ring) {
+			perror("unable to allocate window");
+			exit(1);
+		}
+	}
 
 
 	memset(&stats, 0, sizeof(stats));
-	gettimeofday(&start, NULL);
+	start = nsec_now();
 	last_calc = start;
 	zero_time = start;
 
 	while(1) {
-		gettimeofday(&now, NULL);
-		runtime_delta = tvdelta(&start, &now);
+		now = nsec_now();
+		runtime_delta = nsdelta(start, now);
 
-		if (runtime_usec && runtime_delta >= runtime_usec)
+		if (runtime_nsec && runtime_delta >= runtime_nsec)
 			break;
 
 		if (!requests_per_sec && !pipe_test &&
-		    runtime_delta > warmup_usec &&
+		    runtime_delta > warmup_nsec &&
 		    !warmup_done && warmuptime) {
 			warmup_done = 1;
 			fprintf(stderr, "warmup done, zeroing stats\n");
 			zero_time = now;
 			reset_thread_stats(message_threads_mem);
+			memset(&last_total, 0, sizeof(last_total));
+			window_pos = 0;
+			if (window_ring)
+				memset(window_ring, 0, window_intervals * sizeof(struct stats));
 		} else if (!pipe_test) {
-			delta = tvdelta(&last_calc, &now);
-			if (delta >= interval_usec) {
+			delta = nsdelta(last_calc, now);
+			if (delta >= interval_nsec) {
+				merge_start = thread_cpu_ns();
 				memset(&stats, 0, sizeof(stats));
 				combine_message_thread_stats(&stats, message_threads_mem,
 					     &loop_count, &loop_runtime);
-				show_latencies(&stats, runtime_delta / USEC_PER_SEC);
+				reporter_merge_cpu += thread_cpu_ns() - merge_start;
+				reporter_merges++;
+				if (output_format || hist_log_fd >= 0) {
+					memset(extra, 0, sizeof(extra));
+					for (i = LAT_TOTAL + 1; i < NR_LAT_STATS; i++)
+						combine_lat_stats(&extra[i], message_threads_mem, i);
+				} else if (breakdown) {
+					combine_breakdown_stats(extra, message_threads_mem);
+				}
+				show_latencies(&stats, breakdown ? extra : NULL,
+					       runtime_delta / NSEC_PER_SEC);
+
+				interval_stats = stats;
+				subtract_stats(&interval_stats, &last_total);
+				stats_bucket_bounds(&interval_stats);
+				last_total = stats;
+				if (verbose || window_ring)
+					show_window_summary("this interval", &interval_stats);
+				if (window_ring) {
+					char label[64];
+					int n;
+
+					window_ring[window_pos++ % window_intervals] = interval_stats;
+					n = window_pos < window_intervals ? window_pos : window_intervals;
+					window_filled = n;
+					memset(&window_stats, 0, sizeof(window_stats));
+					for (i = 0; i < n; i++)
+						combine_stats(&window_stats, &window_ring[i]);
+					snprintf(label, sizeof(label), "last %d intervals", n);
+					show_window_summary(label, &window_stats);
+				}
+				sched = schedstat_sample(0);
+				if (sched)
+					show_schedstat(sched);
+				if (task_stats) {
+					memset(task_interval, 0, sizeof(task_interval));
+					sample_task_stats(message_threads_mem,
+							  TASK_SAMPLE_INTERVAL);
+					show_task_stats(task_interval);
+				}
+				stall = stall_sample(0);
+				if (stall)
+					show_stalls(stall);
 				last_calc = now;
 				if (requests_per_sec) {
 					fprintf(stdout, "rps: %.2f\n",
-						(double)(loop_count * USEC_PER_SEC) / runtime_delta);
+						(double)(loop_count * NSEC_PER_SEC) / runtime_delta);
 				}
+				if (output_format)
+					emit_record("interval", runtime_delta / NSEC_PER_SEC,
+						    (double)(loop_count * NSEC_PER_SEC) / runtime_delta,
+						    &stats, extra, &interval_stats,
+						    window_intervals ? &window_stats : NULL,
+						    NULL, 0, 0, 0, sched,
+						    task_stats ? task_interval : NULL, stall);
+				if (hist_log_fd >= 0)
+					hist_log_report(HIST_RECORD_INTERVAL,
+							runtime_delta / NSEC_PER_SEC,
+							(double)(loop_count * NSEC_PER_SEC) / runtime_delta,
+							&stats, extra, NULL);
 			}
 		}
-		if (zero_usec) {
+		if (zero_nsec) {
 			unsigned long long zero_delta;
-			zero_delta = tvdelta(&zero_time, &now);
-			if (zero_delta > zero_usec) {
+			zero_delta = nsdelta(zero_time, now);
+			if (zero_delta > zero_nsec) {
 				zero_time = now;
 				reset_thread_stats(message_threads_mem);
+				memset(&last_total, 0, sizeof(last_total));
 			}
 		}
 		if (auto_rps)
-			auto_scale_rps(&proc_stat_fd, &total_time, &total_idle);
+			auto_scale_rps(&auto_rps_state);
 		sleep(1);
 	}
-	if (proc_stat_fd >= 0)
-		close(proc_stat_fd);
+	free(window_ring);
+	reporter_cpu += thread_cpu_ns() - cpu_start;
+	reporter_wall += nsdelta(start, nsec_now());
+	/* the threads are gone from /proc once they see stopping */
+	if (task_stats)
+		sample_task_stats(message_threads_mem, TASK_SAMPLE_FINAL);
+	__sync_synchronize();
+	stopping = 1;
+	if (wake_ops[wake_backend].broadcast)
+		wake_ops[wake_backend].broadcast();
+}
+
+/* per group latencies, and how much CFS bandwidth control throttled them */
+static void show_groups(void)
+{
+	char label[GROUP_NAME_LEN + 16];
+	int i;
+
+	for (i = 0; i < nr_groups; i++) {
+		struct worker_group *g = groups + i;
+
+		snprintf(label, sizeof(label), "group %.*s", GROUP_NAME_LEN, g->name);
+		show_lat_summary(label, g->final);
+		if (!sched_profile_empty(&g->sched))
+			show_sched_profile(label, &g->sched);
+		if (g->dir[0])
+			fprintf(stdout, "group %s: nr_periods %llu nr_throttled %llu throttled_usec %llu\n",
+				g->name, group_cpu_stat(g, "nr_periods"),
+				group_cpu_stat(g, "nr_throttled"),
+				group_cpu_stat(g, "throttled_usec"));
+	}
+}
+
+/*
+ * --slo-search.  Each step sets the thread count or RPS, gives things a
+ * second to settle, zeros the stats and measures for --probe-time.  The
+ * threads stay up for the whole search, workers we don't want are parked
+ */
+#define SEARCH_SETTLE_SECS 1
+#define SEARCH_MAX_STEPS 64
+/* an RPS step fails if we can't deliver at least this much of it */
+#define SEARCH_MIN_RPS_RATIO 0.9
+
+struct search_point {
+	unsigned long val;
+	unsigned long long lat;
+	double rps;
+	int ok;
+};
+
+static struct search_point search_points[SEARCH_MAX_STEPS];
+static int nr_search_points = 0;
+/* everything up to -t met the slo, the real knee is somewhere past it */
+static int search_hit_limit = 0;
+
+/* any percentile, not just the ones in plist */
+static unsigned long long stats_percentile(struct stats *s, double pct)
+{
+	unsigned long sum = 0;
+	unsigned int i;
+
+	for (i = 0; i < PLAT_NR; i++) {
+		sum += s->plat[i];
+		if (sum && sum >= pct / 100.0 * s->nr_samples)
+			return plat_idx_to_val(i);
+	}
+	return 0;
+}
+
+/* parked workers only look at active_workers when we wake them */
+static void kick_all_workers(struct thread_data *thread_data)
+{
+	int i;
+	int msg_i;
+	int index = 0;
+
+	for (msg_i = 0; msg_i < message_threads; msg_i++) {
+		index++;
+		for (i = 0; i < worker_threads; i++)
+			fpost(thread_data + index++);
+	}
+}
+
+static struct search_point *search_step(struct thread_data *thread_data,
+					unsigned long val)
+{
+	struct search_point *pt;
+	struct stats stats;
+	unsigned long long before, after, loop_runtime;
+	int i;
+
+	/* we've measured this one already */
+	for (i = 0; i < nr_search_points; i++)
+		if (search_points[i].val == val)
+			return search_points + i;
+	if (nr_search_points == SEARCH_MAX_STEPS)
+		return NULL;
+	pt = search_points + nr_search_points++;
+	pt->val = val;
+
+	if (slo_search == SEARCH_THREADS) {
+		active_workers = val;
+		kick_all_workers(thread_data);
+	} else {
+		requests_per_sec = val / message_threads;
+		if (!requests_per_sec)
+			requests_per_sec = 1;
+	}
+	sleep(SEARCH_SETTLE_SECS);
+
+	reset_thread_stats(thread_data);
+	memset(&stats, 0, sizeof(stats));
+	combine_message_thread_stats(&stats, thread_data, &before, &loop_runtime);
+	sleep(probe_time);
+	memset(&stats, 0, sizeof(stats));
+	combine_message_thread_stats(&stats, thread_data, &after, &loop_runtime);
+
+	pt->lat = stats_percentile(&stats, slo_pct);
+	pt->rps = (double)(after - before) / probe_time;
+	pt->ok = stats.nr_samples && pt->lat <= slo_usec * NSEC_PER_USEC;
+	if (slo_search == SEARCH_RPS && pt->rps < val * SEARCH_MIN_RPS_RATIO)
+		pt->ok = 0;
+
+	fprintf(stdout, "search %s %lu: p%.1f (%s) %llu rps %.2f %s\n",
+		search_names[slo_search], val, slo_pct, report_units,
+		pt->lat / report_div, pt->rps, pt->ok ? "ok" : "over");
+	fflush(stdout);
+	return pt;
+}
+
+/*
+ * double until we blow the SLO (or hit -t for threads), then binary
+ * search between the last good step and the first bad one
+ */
+static void run_capacity_search(struct thread_data *thread_data)
+{
+	struct search_point *pt;
+	unsigned long good = 0;
+	unsigned long bad = 0;
+	unsigned long limit = ULONG_MAX;
+	unsigned long val;
+	unsigned long mid;
+	unsigned long resolution;
+	unsigned long long start = nsec_now();
+
+	if (slo_search == SEARCH_THREADS) {
+		limit = worker_threads;
+		val = 1;
+	} else {
+		val = requests_per_sec * message_threads;
+		if (!val)
+			val = 100;
+	}
+
+	while (!bad) {
+		pt = search_step(thread_data, val);
+		if (!pt)
+			break;
+		if (!pt->ok) {
+			bad = val;
+			break;
+		}
+		good = val;
+		if (val == limit) {
+			search_hit_limit = 1;
+			break;
+		}
+		val = val > limit / 2 ? limit : val * 2;
+	}
+
+	while (bad) {
+		/* threads go down to one, RPS to about 2% */
+		resolution = slo_search == SEARCH_THREADS ? 1 : good / 50 + 1;
+		if (bad - good <= resolution)
+			break;
+		mid = good + (bad - good) / 2;
+		pt = search_step(thread_data, mid);
+		if (!pt)
+			break;
+		if (pt->ok)
+			good = mid;
+		else
+			bad = mid;
+	}
+
+	/* the final report covers the whole search, not -r */
+	runtime = nsdelta(start, nsec_now()) / NSEC_PER_SEC;
+	if (!runtime)
+		runtime = 1;
+
 	__sync_synchronize();
 	stopping = 1;
+	if (wake_ops[wake_backend].broadcast)
+		wake_ops[wake_backend].broadcast();
+	/* parked workers need to see stopping too */
+	kick_all_workers(thread_data);
+}
+
+static int cmp_search_point(const void *a, const void *b)
+{
+	const struct search_point *pa = a;
+	const struct search_point *pb = b;
+
+	if (pa->val == pb->val)
+		return 0;
+	return pa->val < pb->val ? -1 : 1;
+}
+
+/* the latency curve in order, then the knee */
+static void show_search_results(void)
+{
+	struct search_point *knee = NULL;
+	int i;
+
+	qsort(search_points, nr_search_points, sizeof(search_points[0]),
+	      cmp_search_point);
+	fprintf(stdout, "latency curve (p%.1f slo %llu usec):\n", slo_pct, slo_usec);
+	for (i = 0; i < nr_search_points; i++) {
+		struct search_point *pt = search_points + i;
+
+		fprintf(stdout, "\t%s %-10lu p%.1f (%s) %-10llu rps %.2f %s\n",
+			search_names[slo_search], pt->val, slo_pct, report_units,
+			pt->lat / report_div, pt->rps, pt->ok ? "ok" : "over");
+		if (pt->ok && (!knee || pt->val > knee->val))
+			knee = pt;
+	}
+	if (knee)
+		fprintf(stdout, "knee: %s %lu p%.1f (%s) %llu rps %.2f\n",
+			search_names[slo_search], knee->val, slo_pct, report_units,
+			knee->lat / report_div, knee->rps);
+	else
+		fprintf(stdout, "knee: nothing we tried met the slo\n");
+	if (search_hit_limit)
+		fprintf(stdout, "limit reached, knee >= %s %lu, raise -t to search further\n",
+			search_names[slo_search], knee->val);
+}
+
+/*
+ * what waking cost the wakers in message mode.  With --wake-fanout the
+ * workers share the posting, and nobody should do more than the fanout
+ */
+struct wake_cost {
+	unsigned long msg_wakes;
+	unsigned long worker_wakes;
+	unsigned long long msg_cost;
+	unsigned long long worker_cost;
+};
+
+static void total_wake_cost(struct thread_data *thread_data, struct wake_cost *wc)
+{
+	int msg_i;
+	int i;
+
+	memset(wc, 0, sizeof(*wc));
+	for (msg_i = 0; msg_i < message_threads; msg_i++) {
+		struct thread_data *td = thread_data + msg_i * worker_threads + msg_i;
+
+		wc->msg_wakes += td->wakes;
+		wc->msg_cost += td->wake_cost;
+		for (i = 1; i <= worker_threads; i++) {
+			wc->worker_wakes += td[i].wakes;
+			wc->worker_cost += td[i].wake_cost;
+		}
+	}
+}
+
+static void show_wake_cost(struct wake_cost *wc)
+{
+	unsigned long msg_wakes = wc->msg_wakes, worker_wakes = wc->worker_wakes;
+	unsigned long long msg_cost = wc->msg_cost, worker_cost = wc->worker_cost;
+
+	if (!msg_wakes && !worker_wakes)
+		return;
+	fprintf(stdout, "waker cost: %.0f cpu ns per wake, %lu wakes, %.1f%% by workers",
+		(double)(msg_cost + worker_cost) / (msg_wakes + worker_wakes),
+		msg_wakes + worker_wakes,
+		(double)worker_wakes * 100 / (msg_wakes + worker_wakes));
+	if (msg_wakes)
+		fprintf(stdout, ", message threads %.0f cpu ns per wake",
+			(double)msg_cost / msg_wakes);
+	fprintf(stdout, "\n");
+}
+
+/* resident bytes right now, from /proc/self/statm */
+static unsigned long long read_rss(void)
+{
+	unsigned long long size, resident = 0;
+	FILE *fp;
+
+	fp = fopen("/proc/self/statm", "r");
+	if (!fp)
+		return 0;
+	if (fscanf(fp, "%llu %llu", &size, &resident) != 2)
+		resident = 0;
+	fclose(fp);
+	return resident * sysconf(_SC_PAGESIZE);
 }
 
+/* rss is from the end of the run, before we tore the threads down */
+static void show_memory(unsigned long long rss, size_t thread_data_bytes)
+{
+	struct rusage ru;
+	char *rss_unit, *peak_unit, *td_unit;
+	double rss_pretty, peak_pretty, td_pretty;
+
+	if (getrusage(RUSAGE_SELF, &ru))
+		ru.ru_maxrss = 0;
+	/* the kernel only updates the high water mark now and then */
+	if ((unsigned long long)ru.ru_maxrss * 1024 < rss)
+		ru.ru_maxrss = rss / 1024;
+	rss_pretty = pretty_size(rss, &rss_unit);
+	peak_pretty = pretty_size((double)ru.ru_maxrss * 1024, &peak_unit);
+	td_pretty = pretty_size(thread_data_bytes, &td_unit);
+	fprintf(stdout, "memory: rss %.2f%s peak rss %.2f%s thread_data %.2f%s mapped (%zu bytes per thread)\n",
+		rss_pretty, rss_unit, peak_pretty, peak_unit, td_pretty, td_unit,
+		sizeof(struct thread_data));
+}
 
 int main(int ac, char **av)
 {
@@ -1294,28 +7840,78 @@ int main(int ac, char **av)
 	struct thread_data *message_threads_mem = NULL;
 	struct stats stats;
 	double loops_per_sec;
-	int p99 = 0;
-	int p95 = 0;
+	unsigned long long p99 = 0;
+	unsigned long long p95 = 0;
 	double diff;
 	unsigned long long loop_count;
 	unsigned long long loop_runtime;
+	unsigned long pool_exhausted = 0;
+	unsigned long backlogged = 0;
+	unsigned long backlog_dropped = 0;
+	struct stats pacer_stats;
+	static struct stats lat_totals[NR_LAT_STATS];
+	unsigned long steals = 0;
+	struct schedstat_sample *sched;
+	struct stall_sample *stall;
+	size_t thread_data_bytes;
+	unsigned long long rss;
+	struct wake_cost wake_cost;
 
 	parse_options(ac, av);
 
+	if (hist_tool)
+		return run_hist_tool();
+	if (trace_path)
+		load_trace();
+	/* a worker can still be sending when we close the channels */
+	if (use_transport())
+		signal(SIGPIPE, SIG_IGN);
+	if (hist_log_path)
+		open_hist_log();
+
+	if (use_tsc)
+		calibrate_tsc();
+
+	if (placement) {
+		read_topology();
+		fprintf(stderr, "placement %s over %d cpus\n",
+			placement_names[placement], nr_topo);
+	}
+
 	if (operations)
-		matrix_size = sqrt(cache_footprint_kb * 1024 / 3 / sizeof(unsigned long));
+		size_kernel();
+
+	for (i = 0; i < nr_groups; i++) {
+		groups[i].base = calloc(1, sizeof(struct stats));
+		groups[i].final = calloc(1, sizeof(struct stats));
+		if (!groups[i].base || !groups[i].final) {
+			perror("unable to allocate group stats");
+			exit(1);
+		}
+	}
+	setup_group_cgroups();
+	start_hogs();
+	schedstat_reset();
+	stall_reset();
 
-again:
 	requests_per_sec /= message_threads;
+	active_workers = worker_threads;
 	loops_per_sec = 0;
 	stopping = 0;
+	wake_stop_futex = 0;
 	memset(&stats, 0, sizeof(stats));
+	memset(base_stats, 0, sizeof(base_stats));
 
-	message_threads_mem = calloc(message_threads * worker_threads + message_threads,
-				      sizeof(struct thread_data));
-
-
-	if (!message_threads_mem) {
+	/*
+	 * mmap instead of calloc so the pages stay untouched until each
+	 * thread writes its own.  A zeroing calloc from here would put the
+	 * whole thing on our node
+	 */
+	thread_data_bytes = (message_threads * worker_threads + message_threads) *
+			    sizeof(struct thread_data);
+	message_threads_mem = mmap(NULL, thread_data_bytes, PROT_READ | PROT_WRITE,
+				   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (message_threads_mem == MAP_FAILED) {
 		perror("unable to allocate message threads");
 		exit(1);
 	}
@@ -1324,8 +7920,25 @@ again:
 	for (i = 0; i < message_threads; i++) {
 		pthread_t tid;
 		int index = i * worker_threads + i;
-		ret = pthread_create(&tid, NULL, message_thread,
-				     message_threads_mem + index);
+
+		message_threads_mem[index].msg_index = i;
+		message_threads_mem[index].cputime = cputime;
+		rng_init(&message_threads_mem[index].rng, index);
+		if (nr_groups) {
+			struct worker_group *g = groups;
+			int first = 0;
+
+			while (i >= first + g->nr_msg) {
+				first += g->nr_msg;
+				g++;
+			}
+			message_threads_mem[index].group = g;
+			if (g->cputime >= 0)
+				message_threads_mem[index].cputime = g->cputime;
+		}
+		wake_init(message_threads_mem + index);
+		ret = create_placed_thread(&tid, i, -1, message_thread,
+					   message_threads_mem + index);
 		if (ret) {
 			fprintf(stderr, "error %d from pthread_create\n", ret);
 			exit(1);
@@ -1333,50 +7946,150 @@ again:
 		message_threads_mem[index].tid = tid;
 	}
 
-	sleep_for_runtime(message_threads_mem);
+	if (slo_search)
+		run_capacity_search(message_threads_mem);
+	else
+		sleep_for_runtime(message_threads_mem);
 
 	for (i = 0; i < message_threads; i++) {
 		int index = i * worker_threads + i;
-		fpost(&message_threads_mem[index].futex);
+		fpost(message_threads_mem + index);
 		pthread_join(message_threads_mem[index].tid, NULL);
+		wake_cleanup(message_threads_mem + index);
 	}
 	memset(&stats, 0, sizeof(stats));
 	combine_message_thread_stats(&stats, message_threads_mem,
 				     &loop_count, &loop_runtime);
 
-	loops_per_sec = loop_count * USEC_PER_SEC;
+	loops_per_sec = loop_count * NSEC_PER_SEC;
 	loops_per_sec /= loop_runtime;
 
-	free(message_threads_mem);
+	if (requests_per_sec) {
+		pool_exhausted = total_pool_exhausted(message_threads_mem);
+		backlogged = total_backlogged(message_threads_mem);
+		backlog_dropped = total_backlog_dropped(message_threads_mem);
+		steals = total_steals(message_threads_mem);
+	}
+	memset(&pacer_stats, 0, sizeof(pacer_stats));
+	if (requests_per_sec && arrivals != ARRIVALS_BATCH)
+		combine_pacer_stats(&pacer_stats, message_threads_mem);
+	memset(lat_totals, 0, sizeof(lat_totals));
+	for (i = LAT_TOTAL + 1; i < NR_LAT_STATS; i++)
+		combine_lat_stats(&lat_totals[i], message_threads_mem, i);
+
+	sched = schedstat_sample(1);
+	stall = stall_sample(1);
+	stop_hogs();
+	combine_group_stats(message_threads_mem);
+	total_wake_cost(message_threads_mem, &wake_cost);
+	free_thread_stats(message_threads_mem);
+	rss = read_rss();
+	munmap(message_threads_mem, thread_data_bytes);
 	calc_p99(&stats, &p95, &p99);
 
-	if (autobench) {
-		fprintf(stdout, "cputime %Lu threads %d p99 %d\n",
-			cputime, worker_threads, p99);
-		if (p99 < 2000) {
-			worker_threads++;
-			goto again;
-		}
-		show_latencies(&stats, runtime);
-	} else {
-		show_latencies(&stats, runtime);
+	if (!slo_search) {
+		show_latencies(&stats, breakdown ? lat_totals : NULL, runtime);
+		if (sched)
+			show_schedstat(sched);
+	}
+	if (output_format)
+		emit_record("final", runtime, (double)loop_count / runtime,
+			    &stats, lat_totals, NULL, NULL, &pacer_stats,
+			    pool_exhausted, backlog_dropped, steals, sched,
+			    task_stats ? task_totals : NULL, stall);
+	if (hist_log_fd >= 0)
+		hist_log_report(HIST_RECORD_FINAL, runtime, (double)loop_count / runtime,
+				&stats, lat_totals, &pacer_stats);
+
+	if (slo_search) {
+		show_search_results();
+		show_hogs();
+		teardown_group_cgroups();
+		return 0;
 	}
 
 	if (pipe_test) {
 		char *pretty;
 		double mb_per_sec;
-		mb_per_sec = (loop_count * pipe_test * USEC_PER_SEC) / loop_runtime;
+		mb_per_sec = ((double)loop_count * pipe_test * NSEC_PER_SEC) / loop_runtime;
 		mb_per_sec = pretty_size(mb_per_sec, &pretty);
-		printf("avg worker transfer: %.2f ops/sec %.2f%s/s\n",
-		       loops_per_sec, mb_per_sec, pretty);
-
+		printf("avg worker transfer: %.2f ops/sec %.2f%s/s over %s\n",
+		       loops_per_sec, mb_per_sec, pretty,
+		       transport_names[use_transport() ? transport : TRANSPORT_MEMSET]);
 	}
 	if (requests_per_sec) {
-		diff = (double)p99 / cputime;
-		fprintf(stdout, "rps: %.2f p95 (usec) %d p99 (usec) %d p95/cputime %.2f%% p99/cputime %.2f%%\n",
-				(double)(loop_count) / runtime, p95, p99, ((double)p95 / cputime) * 100,
+		diff = (double)p99 / (cputime * NSEC_PER_USEC);
+		fprintf(stdout, "rps: %.2f p95 (%s) %llu p99 (%s) %llu p95/cputime %.2f%% p99/cputime %.2f%%\n",
+				(double)(loop_count) / runtime, report_units,
+				p95 / report_div, report_units, p99 / report_div,
+				((double)p95 / (cputime * NSEC_PER_USEC)) * 100,
 				diff * 100);
+		if (backlogged)
+			fprintf(stdout, "%lu requests waited for a free request (%d per worker), "
+				"the wait is in their latency\n",
+				backlogged, request_pool_size);
+		if (pool_exhausted)
+			fprintf(stdout, "dropped %lu requests, request pool (%d per worker) exhausted, "
+				"the percentiles are a lower bound\n",
+				pool_exhausted, request_pool_size);
+		if (backlog_dropped)
+			fprintf(stdout, "dropped %lu arrivals, the dispatch backlog was full or "
+				"never drained, the percentiles are a lower bound\n",
+				backlog_dropped);
+		show_lat_summary("pacer lag", &pacer_stats);
+		if (auto_rps)
+			show_auto_rps(&auto_rps_state);
+		if (steal) {
+			fprintf(stdout, "steals: %lu (%.2f%% of requests)\n",
+				steals, loop_count ? (double)steals * 100 / loop_count : 0);
+			show_lat_summary(lat_stats_names[LAT_QUEUE], &lat_totals[LAT_QUEUE]);
+			show_lat_summary(lat_stats_names[LAT_SERVICE], &lat_totals[LAT_SERVICE]);
+		}
+	}
+	if (placement) {
+		char label[64];
+
+		for (i = LAT_SAME_CORE; i <= LAT_CROSS_NODE; i++) {
+			snprintf(label, sizeof(label), "%s wakeups", lat_stats_names[i]);
+			show_lat_summary(label, &lat_totals[i]);
+		}
+	}
+	if (trace) {
+		char label[32];
+
+		for (i = 0; i < trace_classes; i++) {
+			snprintf(label, sizeof(label), "trace class %d", i);
+			show_lat_summary(label, &lat_totals[LAT_CLASS0 + i]);
+		}
+	}
+	if (stall) {
+		double r;
+
+		show_stalls(stall);
+		show_lat_summary("worker stalls", &lat_totals[LAT_STALL]);
+		if (stall_steal_correlation(&r))
+			fprintf(stdout, "stall/steal correlation: %.2f over %lu cpu intervals\n",
+				r, stall_corr.n);
+		else
+			fprintf(stdout, "stall/steal correlation: n/a, no steal time or no stalls to compare\n");
+	}
+	if (wake_fanout && !requests_per_sec)
+		show_wake_cost(&wake_cost);
+	if (verbose) {
+		show_memory(rss, thread_data_bytes);
+		show_reporter_cpu();
+	}
+	if (nr_groups)
+		show_groups();
+	if (task_stats) {
+		show_task_stats(task_totals);
+		if (task_top.migrations)
+			fprintf(stdout, "most migrations: message thread %d worker %d (tid %d) %llu\n",
+				task_top.msg_index, task_top.worker,
+				(int)task_top.task_id, task_top.migrations);
 	}
+	show_hogs();
+	teardown_group_cgroups();
 
 	return 0;
 }